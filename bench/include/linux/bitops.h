@@ -0,0 +1,6 @@
+#ifndef BENCH_LINUX_BITOPS_H
+#define BENCH_LINUX_BITOPS_H
+
+#define __ffs(word) ((unsigned long)__builtin_ctzl(word))
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef BENCH_LINUX_KERNEL_H
+#define BENCH_LINUX_KERNEL_H
+
+/* Just enough of the kernel's headers to build the driver's pure code (like validate.c) in userspace. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define __user
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
+
+#define BUG() abort()
+#define BUG_ON(cond) do { if (cond) abort(); } while (0)
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+typedef uint64_t dma_addr_t;
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef BENCH_LINUX_TYPES_H
+#define BENCH_LINUX_TYPES_H
+
+#include "kernel.h"
+
+#endif
@@ -0,0 +1,240 @@
+/* Round-trip latency of small batches: write() of 1, 4 and 16 tiny FILL_RECTs to a context,
+   then poll() until the context is readable (all of its batches have finished).
+   Runs with the CMD_SEND fast path allowed and turned off, through the device's direct_max_cmds
+   sysfs attribute (which needs root); the attribute is restored afterwards. The fast path is off
+   by default, so its limit is given with -m, or else taken from the attribute. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../doomdev2.h"
+
+#define MAX_BATCH 16
+#define DEFAULT_ITERATIONS 10000
+#define WARMUP_ITERATIONS 100
+
+static const unsigned batch_sizes[] = { 1, 4, 16 };
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Path of the device's sysfs attribute 'name', found through its device number. */
+static int attr_path(const char* dev_path, const char* name, char* path, size_t size) {
+    struct stat st;
+    if (stat(dev_path, &st)) {
+        perror(dev_path);
+        return -1;
+    }
+    snprintf(path, size, "/sys/dev/char/%u:%u/%s", major(st.st_rdev), minor(st.st_rdev), name);
+    return 0;
+}
+
+static int read_attr(const char* path, unsigned long long* val) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    int ok = fscanf(f, "%llu", val) == 1;
+    fclose(f);
+    if (!ok) {
+        fprintf(stderr, "%s: can't parse\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static int write_attr(const char* path, unsigned long long val) {
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    int ok = fprintf(f, "%llu\n", val) > 0;
+    ok &= fclose(f) == 0;
+    if (!ok) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Time 'iterations' round trips of batches of 'num_cmds' commands, storing them in 'times'. */
+static int run(int ctx, const struct doomdev2_cmd* cmds, unsigned num_cmds, uint64_t* times, size_t iterations) {
+    struct pollfd pfd = { .fd = ctx, .events = POLLIN };
+    size_t size = num_cmds * sizeof(struct doomdev2_cmd);
+
+    for (size_t it = 0; it < WARMUP_ITERATIONS + iterations; ++it) {
+        uint64_t start = now_ns();
+        ssize_t ret = write(ctx, cmds, size);
+        if (ret != (ssize_t)size) {
+            fprintf(stderr, "write: %s\n", ret < 0 ? strerror(errno) : "short write");
+            return -1;
+        }
+        do {
+            ret = poll(&pfd, 1, -1);
+        } while (ret < 0 && errno == EINTR);
+        if (ret < 0) {
+            perror("poll");
+            return -1;
+        }
+        uint64_t end = now_ns();
+
+        if (it >= WARMUP_ITERATIONS) {
+            times[it - WARMUP_ITERATIONS] = end - start;
+        }
+    }
+    return 0;
+}
+
+static void report(const char* mode, unsigned num_cmds, uint64_t* times, size_t iterations,
+        unsigned long long direct) {
+    qsort(times, iterations, sizeof(uint64_t), cmp_u64);
+    uint64_t sum = 0;
+    for (size_t it = 0; it < iterations; ++it) {
+        sum += times[it];
+    }
+    printf("%-9s %5u %10.2f %10.2f %10.2f %10llu\n", mode, num_cmds,
+            sum / 1000.0 / iterations, times[iterations / 2] / 1000.0,
+            times[iterations * 99 / 100] / 1000.0, direct);
+}
+
+int main(int argc, char** argv) {
+    const char* dev_path = "/dev/doom0";
+    size_t iterations = DEFAULT_ITERATIONS;
+    unsigned long long fast_max = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:n:m:")) != -1) {
+        switch (opt) {
+        case 'd':
+            dev_path = optarg;
+            break;
+        case 'n':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            fast_max = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-d device] [-n iterations] [-m fast path max cmds]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!iterations) {
+        fprintf(stderr, "need at least one iteration\n");
+        return 1;
+    }
+
+    char max_path[256], direct_path[256];
+    if (attr_path(dev_path, "direct_max_cmds", max_path, sizeof(max_path))
+            || attr_path(dev_path, "direct_batches", direct_path, sizeof(direct_path))) {
+        return 1;
+    }
+    unsigned long long saved_max;
+    if (read_attr(max_path, &saved_max)) {
+        return 1;
+    }
+    if (!fast_max) {
+        fast_max = saved_max;
+    }
+
+    int ctx = open(dev_path, O_RDWR);
+    if (ctx < 0) {
+        perror(dev_path);
+        return 1;
+    }
+
+    struct doomdev2_ioctl_create_surface surface = { .width = 64, .height = 64 };
+    int surf = ioctl(ctx, DOOMDEV2_IOCTL_CREATE_SURFACE, &surface);
+    if (surf < 0) {
+        perror("create surface");
+        return 1;
+    }
+    struct doomdev2_ioctl_setup setup = {
+        .surf_dst_fd = surf,
+        .surf_src_fd = -1,
+        .texture_fd = -1,
+        .flat_fd = -1,
+        .colormap_fd = -1,
+        .translation_fd = -1,
+        .tranmap_fd = -1,
+    };
+    if (ioctl(ctx, DOOMDEV2_IOCTL_SETUP, &setup)) {
+        perror("setup");
+        return 1;
+    }
+
+    /* Single pixels, so that the time is spent getting the commands to the device. */
+    struct doomdev2_cmd cmds[MAX_BATCH];
+    memset(cmds, 0, sizeof(cmds));
+    for (unsigned i = 0; i < MAX_BATCH; ++i) {
+        struct doomdev2_cmd_fill_rect* fill = &cmds[i].fill_rect;
+        fill->type = DOOMDEV2_CMD_TYPE_FILL_RECT;
+        fill->fill_color = i;
+        fill->width = 1;
+        fill->height = 1;
+        fill->pos_x = i;
+    }
+
+    uint64_t* times = malloc(iterations * sizeof(uint64_t));
+    if (!times) {
+        perror("malloc");
+        return 1;
+    }
+
+    static const struct {
+        const char* name;
+        int fast;
+    } modes[] = { { "fast path", 1 }, { "ring only", 0 } };
+
+    int rc = 0;
+    printf("%-9s %5s %10s %10s %10s %10s\n", "mode", "cmds", "mean us", "median us", "p99 us", "direct");
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]) && !rc; ++m) {
+        if (modes[m].fast && !fast_max) {
+            fprintf(stderr, "%s is 0 and no -m given, skipping the fast path\n", max_path);
+            continue;
+        }
+        if (write_attr(max_path, modes[m].fast ? fast_max : 0)) {
+            rc = 1;
+            break;
+        }
+        for (size_t b = 0; b < sizeof(batch_sizes) / sizeof(batch_sizes[0]); ++b) {
+            unsigned long long direct_before, direct_after;
+            if (read_attr(direct_path, &direct_before)
+                    || run(ctx, cmds, batch_sizes[b], times, iterations)
+                    || read_attr(direct_path, &direct_after)) {
+                rc = 1;
+                break;
+            }
+            report(modes[m].name, batch_sizes[b], times, iterations, direct_after - direct_before);
+        }
+    }
+
+    if (write_attr(max_path, saved_max)) {
+        rc = 1;
+    }
+    free(times);
+    close(surf);
+    close(ctx);
+    return rc;
+}
@@ -0,0 +1,452 @@
+/* Compares the table-driven validate_cmds of validate.c with the switch-based validate_cmd it replaced,
+   on batches of MAX_WRITE_CMDS commands shaped like a Doom frame and on less friendly mixes.
+   Both validators must agree on every batch, including ones with an invalid command planted in them. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <time.h>
+
+#include "../doomdev2.h"
+#include "../validate.h"
+
+#define BATCH_CMDS 1024
+#define NUM_BATCHES 64
+/* Each validator runs for about this long on each workload. */
+#define RUN_NS 500000000ull
+
+#define SURF_WIDTH 640
+#define SURF_HEIGHT 480
+#define FLATS 64
+#define TRANSLATIONS 16
+#define COLORMAPS 32
+
+/* The buffers, as far as compute_bind_limits looks at them. */
+struct hd2_buffer {
+    uint16_t width;
+    uint16_t height;
+    size_t size;
+};
+
+uint16_t get_buff_width(const struct hd2_buffer* buff) {
+    return buff->width;
+}
+
+uint16_t get_buff_height(const struct hd2_buffer* buff) {
+    return buff->height;
+}
+
+size_t get_buff_size(const struct hd2_buffer* buff) {
+    return buff->size;
+}
+
+/* The switch-based validator, as it was before validation became table-driven (minus the DEBUG calls,
+   which compile to nothing). It lived in its own translation unit and was called for each command. */
+
+struct switch_limits {
+    uint16_t surf_width;
+    uint16_t surf_height;
+    uint32_t flats;
+    uint32_t translations;
+    uint32_t colormaps;
+    bool has_src;
+    bool has_texture;
+    bool has_tranmap;
+    bool src_is_dst;
+};
+
+static bool switch_validate_maps(const struct switch_limits* limits, uint8_t flags, uint16_t colormap_idx,
+        uint16_t translation_idx) {
+    if (flags & DOOMDEV2_CMD_FLAGS_TRANMAP && !limits->has_tranmap) {
+        return false;
+    }
+    if (flags & DOOMDEV2_CMD_FLAGS_TRANSLATE && translation_idx >= limits->translations) {
+        return false;
+    }
+    if (flags & DOOMDEV2_CMD_FLAGS_COLORMAP && colormap_idx >= limits->colormaps) {
+        return false;
+    }
+    return true;
+}
+
+static __attribute__((noinline)) bool switch_validate_cmd(const struct switch_limits* limits,
+        const struct doomdev2_cmd* user_cmd) {
+    uint16_t surf_width = limits->surf_width, surf_height = limits->surf_height;
+    BUG_ON(!surf_width);
+
+    switch (user_cmd->type) {
+    case DOOMDEV2_CMD_TYPE_COPY_RECT: {
+        if (!limits->has_src) {
+            return false;
+        }
+
+        const struct doomdev2_cmd_copy_rect* cmd = &user_cmd->copy_rect;
+        if ((uint32_t)cmd->pos_dst_x + cmd->width > surf_width ||
+                (uint32_t)cmd->pos_dst_y + cmd->height > surf_height ||
+                (uint32_t)cmd->pos_src_x + cmd->width > surf_width ||
+                (uint32_t)cmd->pos_src_y + cmd->height > surf_height) {
+            return false;
+        }
+
+        if (limits->src_is_dst &&
+               cmd->pos_dst_x < cmd->pos_src_x + cmd->width && cmd->pos_dst_x + cmd->width > cmd->pos_src_x &&
+               cmd->pos_dst_y < cmd->pos_src_y + cmd->height && cmd->pos_dst_y + cmd->height > cmd->pos_src_y) {
+            return false;
+        }
+        return true;
+    }
+    case DOOMDEV2_CMD_TYPE_FILL_RECT: {
+        const struct doomdev2_cmd_fill_rect* cmd = &user_cmd->fill_rect;
+        return (uint32_t)cmd->pos_x + cmd->width <= surf_width && (uint32_t)cmd->pos_y + cmd->height <= surf_height;
+    }
+    case DOOMDEV2_CMD_TYPE_DRAW_LINE: {
+        const struct doomdev2_cmd_draw_line* cmd = &user_cmd->draw_line;
+        return !(cmd->pos_a_x >= surf_width || cmd->pos_a_y >= surf_height
+                || cmd->pos_b_x >= surf_width || cmd->pos_b_y >= surf_height);
+    }
+    case DOOMDEV2_CMD_TYPE_DRAW_BACKGROUND: {
+        const struct doomdev2_cmd_draw_background* cmd = &user_cmd->draw_background;
+        if ((uint32_t)cmd->pos_x + cmd->width > surf_width || (uint32_t)cmd->pos_y + cmd->height > surf_height) {
+            return false;
+        }
+        return cmd->flat_idx < limits->flats;
+    }
+    case DOOMDEV2_CMD_TYPE_DRAW_COLUMN: {
+        if (!limits->has_texture) {
+            return false;
+        }
+
+        const struct doomdev2_cmd_draw_column* cmd = &user_cmd->draw_column;
+        if (cmd->pos_x >= surf_width || cmd->pos_b_y >= surf_height) {
+            return false;
+        }
+        if (cmd->pos_b_y < cmd->pos_a_y) {
+            return false;
+        }
+        return switch_validate_maps(limits, cmd->flags, cmd->colormap_idx, cmd->translation_idx);
+    }
+    case DOOMDEV2_CMD_TYPE_DRAW_SPAN: {
+        const struct doomdev2_cmd_draw_span* cmd = &user_cmd->draw_span;
+        if (cmd->pos_y >= surf_height || cmd->pos_b_x >= surf_width) {
+            return false;
+        }
+        if (cmd->pos_b_x < cmd->pos_a_x) {
+            return false;
+        }
+        if (cmd->flat_idx >= limits->flats) {
+            return false;
+        }
+        return switch_validate_maps(limits, cmd->flags, cmd->colormap_idx, cmd->translation_idx);
+    }
+    case DOOMDEV2_CMD_TYPE_DRAW_FUZZ: {
+        const struct doomdev2_cmd_draw_fuzz* cmd = &user_cmd->draw_fuzz;
+        if (cmd->pos_x >= surf_width || cmd->fuzz_end >= surf_height) {
+            return false;
+        }
+        if (cmd->fuzz_start > cmd->pos_a_y || cmd->pos_a_y > cmd->pos_b_y || cmd->pos_b_y > cmd->fuzz_end) {
+            return false;
+        }
+        if (cmd->colormap_idx >= limits->colormaps) {
+            return false;
+        }
+        return cmd->fuzz_pos <= 55;
+    }
+    }
+
+    return false;
+}
+
+/* How the old write path used it: one call per command, stopping at the first invalid one. */
+static size_t switch_validate_cmds(const struct switch_limits* limits, const struct doomdev2_cmd* cmds,
+        size_t num_cmds) {
+    size_t it;
+    for (it = 0; it < num_cmds; ++it) {
+        if (!switch_validate_cmd(limits, &cmds[it])) {
+            break;
+        }
+    }
+    return it;
+}
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+static uint32_t rnd(uint32_t bound) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)(rng_state >> 32) % bound;
+}
+
+static uint8_t rnd_map_flags(void) {
+    return rnd(8) & (DOOMDEV2_CMD_FLAGS_TRANSLATE | DOOMDEV2_CMD_FLAGS_COLORMAP | DOOMDEV2_CMD_FLAGS_TRANMAP);
+}
+
+/* A random valid command of type 'type'. */
+static void make_valid_cmd(struct doomdev2_cmd* cmd, uint8_t type) {
+    memset(cmd, 0, sizeof(struct doomdev2_cmd));
+    cmd->type = type;
+
+    switch (type) {
+    case DOOMDEV2_CMD_TYPE_COPY_RECT: {
+        struct doomdev2_cmd_copy_rect* c = &cmd->copy_rect;
+        c->width = 1 + rnd(SURF_WIDTH / 2);
+        c->height = 1 + rnd(SURF_HEIGHT);
+        c->pos_src_x = rnd(SURF_WIDTH / 2 - c->width + 1);
+        c->pos_dst_x = SURF_WIDTH / 2 + rnd(SURF_WIDTH / 2 - c->width + 1);
+        c->pos_src_y = rnd(SURF_HEIGHT - c->height + 1);
+        c->pos_dst_y = rnd(SURF_HEIGHT - c->height + 1);
+        break;
+    }
+    case DOOMDEV2_CMD_TYPE_FILL_RECT: {
+        struct doomdev2_cmd_fill_rect* c = &cmd->fill_rect;
+        c->width = 1 + rnd(SURF_WIDTH);
+        c->height = 1 + rnd(SURF_HEIGHT);
+        c->pos_x = rnd(SURF_WIDTH - c->width + 1);
+        c->pos_y = rnd(SURF_HEIGHT - c->height + 1);
+        break;
+    }
+    case DOOMDEV2_CMD_TYPE_DRAW_LINE: {
+        struct doomdev2_cmd_draw_line* c = &cmd->draw_line;
+        c->pos_a_x = rnd(SURF_WIDTH);
+        c->pos_a_y = rnd(SURF_HEIGHT);
+        c->pos_b_x = rnd(SURF_WIDTH);
+        c->pos_b_y = rnd(SURF_HEIGHT);
+        break;
+    }
+    case DOOMDEV2_CMD_TYPE_DRAW_BACKGROUND: {
+        struct doomdev2_cmd_draw_background* c = &cmd->draw_background;
+        c->flat_idx = rnd(FLATS);
+        c->width = 1 + rnd(SURF_WIDTH);
+        c->height = 1 + rnd(SURF_HEIGHT);
+        c->pos_x = rnd(SURF_WIDTH - c->width + 1);
+        c->pos_y = rnd(SURF_HEIGHT - c->height + 1);
+        break;
+    }
+    case DOOMDEV2_CMD_TYPE_DRAW_COLUMN: {
+        struct doomdev2_cmd_draw_column* c = &cmd->draw_column;
+        c->flags = rnd_map_flags();
+        c->pos_x = rnd(SURF_WIDTH);
+        c->pos_a_y = rnd(SURF_HEIGHT);
+        c->pos_b_y = c->pos_a_y + rnd(SURF_HEIGHT - c->pos_a_y);
+        c->colormap_idx = rnd(COLORMAPS);
+        c->translation_idx = rnd(TRANSLATIONS);
+        break;
+    }
+    case DOOMDEV2_CMD_TYPE_DRAW_SPAN: {
+        struct doomdev2_cmd_draw_span* c = &cmd->draw_span;
+        c->flags = rnd_map_flags();
+        c->pos_y = rnd(SURF_HEIGHT);
+        c->pos_a_x = rnd(SURF_WIDTH);
+        c->pos_b_x = c->pos_a_x + rnd(SURF_WIDTH - c->pos_a_x);
+        c->colormap_idx = rnd(COLORMAPS);
+        c->translation_idx = rnd(TRANSLATIONS);
+        c->flat_idx = rnd(FLATS);
+        break;
+    }
+    case DOOMDEV2_CMD_TYPE_DRAW_FUZZ: {
+        struct doomdev2_cmd_draw_fuzz* c = &cmd->draw_fuzz;
+        c->fuzz_pos = rnd(56);
+        c->pos_x = rnd(SURF_WIDTH);
+        c->fuzz_start = rnd(SURF_HEIGHT);
+        c->fuzz_end = c->fuzz_start + rnd(SURF_HEIGHT - c->fuzz_start);
+        c->pos_a_y = c->fuzz_start + rnd(c->fuzz_end - c->fuzz_start + 1);
+        c->pos_b_y = c->pos_a_y + rnd(c->fuzz_end - c->pos_a_y + 1);
+        c->colormap_idx = rnd(COLORMAPS);
+        break;
+    }
+    default:
+        BUG();
+    }
+}
+
+/* Make 'cmd' invalid in a way that depends on its type. */
+static void break_cmd(struct doomdev2_cmd* cmd) {
+    switch (cmd->type) {
+    case DOOMDEV2_CMD_TYPE_DRAW_COLUMN:
+        cmd->draw_column.pos_b_y = SURF_HEIGHT;
+        break;
+    case DOOMDEV2_CMD_TYPE_DRAW_SPAN:
+        cmd->draw_span.flat_idx = FLATS;
+        break;
+    case DOOMDEV2_CMD_TYPE_DRAW_FUZZ:
+        cmd->draw_fuzz.fuzz_pos = 56;
+        break;
+    default:
+        cmd->type = 0xff;
+        break;
+    }
+}
+
+enum workload {
+    /* Runs of columns and spans with a few other commands in between, like a rendered frame. */
+    WORKLOAD_FRAME,
+    /* Nothing but columns. */
+    WORKLOAD_COLUMNS,
+    /* Every command of a random type, so that there are no runs to speak of. */
+    WORKLOAD_SHUFFLED,
+    NUM_WORKLOADS,
+};
+
+static const char* const workload_names[NUM_WORKLOADS] = {
+    [WORKLOAD_FRAME] = "frame",
+    [WORKLOAD_COLUMNS] = "columns",
+    [WORKLOAD_SHUFFLED] = "shuffled",
+};
+
+static const uint8_t other_types[] = {
+    DOOMDEV2_CMD_TYPE_COPY_RECT,
+    DOOMDEV2_CMD_TYPE_FILL_RECT,
+    DOOMDEV2_CMD_TYPE_DRAW_LINE,
+    DOOMDEV2_CMD_TYPE_DRAW_BACKGROUND,
+    DOOMDEV2_CMD_TYPE_DRAW_FUZZ,
+};
+
+static void make_batch(struct doomdev2_cmd* cmds, enum workload workload) {
+    size_t it = 0;
+    while (it < BATCH_CMDS) {
+        uint8_t type;
+        size_t run = 1;
+        switch (workload) {
+        case WORKLOAD_FRAME: {
+            uint32_t pick = rnd(100);
+            if (pick < 65) {
+                type = DOOMDEV2_CMD_TYPE_DRAW_COLUMN;
+                run = 1 + rnd(64);
+            } else if (pick < 90) {
+                type = DOOMDEV2_CMD_TYPE_DRAW_SPAN;
+                run = 1 + rnd(32);
+            } else {
+                type = other_types[rnd(ARRAY_SIZE(other_types))];
+            }
+            break;
+        }
+        case WORKLOAD_COLUMNS:
+            type = DOOMDEV2_CMD_TYPE_DRAW_COLUMN;
+            break;
+        default: {
+            static const uint8_t all_types[] = {
+                DOOMDEV2_CMD_TYPE_COPY_RECT,
+                DOOMDEV2_CMD_TYPE_FILL_RECT,
+                DOOMDEV2_CMD_TYPE_DRAW_LINE,
+                DOOMDEV2_CMD_TYPE_DRAW_BACKGROUND,
+                DOOMDEV2_CMD_TYPE_DRAW_COLUMN,
+                DOOMDEV2_CMD_TYPE_DRAW_SPAN,
+                DOOMDEV2_CMD_TYPE_DRAW_FUZZ,
+            };
+            type = all_types[rnd(ARRAY_SIZE(all_types))];
+            break;
+        }
+        }
+        for (; run && it < BATCH_CMDS; --run, ++it) {
+            make_valid_cmd(&cmds[it], type);
+        }
+    }
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Keeps the compiler from dropping the validation. */
+static volatile size_t sink;
+
+static double time_table(const struct bind_limits* limits, const struct doomdev2_cmd* batches) {
+    uint64_t start = now_ns(), end, rounds = 0;
+    do {
+        for (size_t b = 0; b < NUM_BATCHES; ++b) {
+            sink = validate_cmds(limits, &batches[b * BATCH_CMDS], BATCH_CMDS);
+        }
+        ++rounds;
+    } while ((end = now_ns()) - start < RUN_NS);
+    return (double)(end - start) / (rounds * NUM_BATCHES * BATCH_CMDS);
+}
+
+static double time_switch(const struct switch_limits* limits, const struct doomdev2_cmd* batches) {
+    uint64_t start = now_ns(), end, rounds = 0;
+    do {
+        for (size_t b = 0; b < NUM_BATCHES; ++b) {
+            sink = switch_validate_cmds(limits, &batches[b * BATCH_CMDS], BATCH_CMDS);
+        }
+        ++rounds;
+    } while ((end = now_ns()) - start < RUN_NS);
+    return (double)(end - start) / (rounds * NUM_BATCHES * BATCH_CMDS);
+}
+
+/* Both validators must find the same valid prefix, with and without an invalid command in the batch. */
+static bool check_agree(const struct bind_limits* limits, const struct switch_limits* old_limits,
+        struct doomdev2_cmd* batch) {
+    size_t got = validate_cmds(limits, batch, BATCH_CMDS);
+    size_t want = switch_validate_cmds(old_limits, batch, BATCH_CMDS);
+    if (got != want || got != BATCH_CMDS) {
+        fprintf(stderr, "valid batch: table-driven %zu, switch %zu\n", got, want);
+        return false;
+    }
+
+    size_t bad = rnd(BATCH_CMDS);
+    struct doomdev2_cmd saved = batch[bad];
+    break_cmd(&batch[bad]);
+    got = validate_cmds(limits, batch, BATCH_CMDS);
+    want = switch_validate_cmds(old_limits, batch, BATCH_CMDS);
+    batch[bad] = saved;
+    if (got != want || got != bad) {
+        fprintf(stderr, "invalid cmd %zu: table-driven %zu, switch %zu\n", bad, got, want);
+        return false;
+    }
+    return true;
+}
+
+int main(void) {
+    struct hd2_buffer surface = { .width = SURF_WIDTH, .height = SURF_HEIGHT };
+    struct hd2_buffer texture = { .size = 1 << 20 };
+    struct hd2_buffer flat = { .size = FLATS << 12 };
+    struct hd2_buffer translation = { .size = TRANSLATIONS << 8 };
+    struct hd2_buffer colormap = { .size = COLORMAPS << 8 };
+    struct hd2_buffer tranmap = { .size = 1 << 16 };
+    struct hd2_buffer* bufs[NUM_USER_BUFS] = {
+        [DST_BUF_IDX] = &surface,
+        [SRC_BUF_IDX] = &surface,
+        [TEXTURE_BUF_IDX] = &texture,
+        [FLAT_BUF_IDX] = &flat,
+        [TRANSLATE_BUF_IDX] = &translation,
+        [COLORMAP_BUF_IDX] = &colormap,
+        [TRANMAP_BUF_IDX] = &tranmap,
+    };
+
+    struct bind_limits limits;
+    compute_bind_limits(&limits, bufs);
+    struct switch_limits old_limits = {
+        .surf_width = SURF_WIDTH,
+        .surf_height = SURF_HEIGHT,
+        .flats = FLATS,
+        .translations = TRANSLATIONS,
+        .colormaps = COLORMAPS,
+        .has_src = true,
+        .has_texture = true,
+        .has_tranmap = true,
+        .src_is_dst = true,
+    };
+
+    struct doomdev2_cmd* batches = malloc(NUM_BATCHES * BATCH_CMDS * sizeof(struct doomdev2_cmd));
+    if (!batches) {
+        perror("malloc");
+        return 1;
+    }
+
+    printf("%-10s %14s %14s %8s\n", "workload", "switch ns/cmd", "table ns/cmd", "speedup");
+    for (int workload = 0; workload < NUM_WORKLOADS; ++workload) {
+        for (size_t b = 0; b < NUM_BATCHES; ++b) {
+            make_batch(&batches[b * BATCH_CMDS], workload);
+            if (!check_agree(&limits, &old_limits, &batches[b * BATCH_CMDS])) {
+                return 1;
+            }
+        }
+
+        double old_ns = time_switch(&old_limits, batches);
+        double new_ns = time_table(&limits, batches);
+        printf("%-10s %14.2f %14.2f %7.2fx\n", workload_names[workload], old_ns, new_ns, old_ns / new_ns);
+    }
+
+    free(batches);
+    return 0;
+}
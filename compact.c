@@ -0,0 +1,95 @@
+#include <linux/kernel.h>
+
+#include "doomdev2.h"
+
+#include "common.h"
+
+#include "compact.h"
+
+void init_column_decoder(struct column_decoder* dec, const struct doomdev2_cmd_draw_column* base,
+        const uint8_t* data, size_t size, uint32_t num_cmds) {
+    dec->data = data;
+    dec->size = size;
+    dec->pos = 0;
+    dec->prev = *base;
+    dec->prev.type = DOOMDEV2_CMD_TYPE_DRAW_COLUMN;
+    dec->left = num_cmds;
+}
+
+/* Read a zigzag LEB128 varint of at most 32 bits. Returns false if the stream is malformed. */
+static bool read_delta(struct column_decoder* dec, uint32_t* delta) {
+    uint32_t val = 0;
+    unsigned shift;
+    for (shift = 0; shift < 35; shift += 7) {
+        if (dec->pos == dec->size) {
+            return false;
+        }
+        uint8_t byte = dec->data[dec->pos++];
+        /* The fifth byte holds only the top 4 bits. */
+        if (shift == 28 && (byte & 0x70)) {
+            return false;
+        }
+        val |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *delta = (val >> 1) ^ -(val & 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+ssize_t decode_columns(struct column_decoder* dec, struct doomdev2_cmd* cmds, size_t num) {
+    struct doomdev2_cmd_draw_column* col = &dec->prev;
+    size_t it;
+
+    for (it = 0; it < num && dec->left; ++it, --dec->left) {
+        if (dec->pos == dec->size) {
+            DEBUG("decode_columns: stream too short");
+            goto malformed;
+        }
+        uint8_t mask = dec->data[dec->pos++];
+        if (mask & ~DOOMDEV2_COLUMN_ALL) {
+            DEBUG("decode_columns: unknown bits %x", mask);
+            goto malformed;
+        }
+
+        uint32_t delta;
+        bool ok = true;
+        if (mask & DOOMDEV2_COLUMN_NEXT_X) {
+            ++col->pos_x;
+        }
+        if (mask & DOOMDEV2_COLUMN_POS_X && (ok = read_delta(dec, &delta))) {
+            col->pos_x += delta;
+        }
+        if (mask & DOOMDEV2_COLUMN_POS_A_Y && ok && (ok = read_delta(dec, &delta))) {
+            col->pos_a_y += delta;
+        }
+        if (mask & DOOMDEV2_COLUMN_POS_B_Y && ok && (ok = read_delta(dec, &delta))) {
+            col->pos_b_y += delta;
+        }
+        if (mask & DOOMDEV2_COLUMN_TEXTURE_OFFSET && ok && (ok = read_delta(dec, &delta))) {
+            col->texture_offset += delta;
+        }
+        if (mask & DOOMDEV2_COLUMN_USTART && ok && (ok = read_delta(dec, &delta))) {
+            col->ustart += delta;
+        }
+        if (mask & DOOMDEV2_COLUMN_USTEP && ok && (ok = read_delta(dec, &delta))) {
+            col->ustep += delta;
+        }
+        if (!ok) {
+            DEBUG("decode_columns: bad varint");
+            goto malformed;
+        }
+
+        memset(&cmds[it], 0, sizeof(struct doomdev2_cmd));
+        cmds[it].draw_column = *col;
+    }
+
+    return it;
+
+malformed:
+    /* The columns before the malformed one are still good; the next call reports the error. */
+    dec->pos = dec->size;
+    dec->left = 1;
+    return it ? it : -EINVAL;
+}
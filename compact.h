@@ -0,0 +1,26 @@
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#include <linux/types.h>
+
+#include "doomdev2.h"
+
+/* Expands a compact run of columns (see struct doomdev2_ioctl_draw_columns) into regular commands. */
+struct column_decoder {
+    const uint8_t* data;
+    size_t size;
+    size_t pos;
+
+    /* The last column decoded (or the base), which the next one is relative to. */
+    struct doomdev2_cmd_draw_column prev;
+    uint32_t left;
+};
+
+void init_column_decoder(struct column_decoder* dec, const struct doomdev2_cmd_draw_column* base,
+        const uint8_t* data, size_t size, uint32_t num_cmds);
+
+/* Decode up to 'num' next columns into 'cmds'. Returns the number of columns decoded
+   (0 once all are) or -EINVAL if the stream is malformed. */
+ssize_t decode_columns(struct column_decoder* dec, struct doomdev2_cmd* cmds, size_t num);
+
+#endif
@@ -1,17 +1,36 @@
+#include <linux/capability.h>
 #include <linux/fs.h>
+#include <linux/hrtimer.h>
+#include <linux/idr.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
 #include <linux/slab.h>
+#include <linux/splice.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
 
 #include "doomdev2.h"
 
 #include "hd2.h"
 #include "hd2_buffer.h"
+#include "validate.h"
+#include "compact.h"
 #include "common.h"
 
 #include "context.h"
 
 /* Maximum number of commands sent to the device in a batch. */
-#define MAX_BATCH_CMDS 1024
+#define MAX_BATCH_CMDS MAX_WRITE_CMDS
+
+/* With coalescing enabled, writes of at most COALESCE_WRITE_CMDS commands are held back
+   until COALESCE_CMDS pile up. */
+#define COALESCE_WRITE_CMDS 64
+#define COALESCE_CMDS MAX_BATCH_CMDS
+
+/* Writes with at least this many commands left are validated and encoded on several CPUs,
+   up to MAX_LIST_CMDS commands at a time. */
+#define LARGE_WRITE_CMDS 16384
 
 #define SSIZE_MAX LONG_MAX
 _Static_assert(sizeof(ssize_t) == sizeof(long), "ssize_t");
@@ -20,13 +39,127 @@ _Static_assert(sizeof(ssize_t) == sizeof(long), "ssize_t");
    we can only write as many bytes as ssize_t can hold. */
 #define MAX_CMDS (SSIZE_MAX / sizeof(struct doomdev2_cmd))
 
+#define RING_MAP_SIZE PAGE_ALIGN(sizeof(struct doomdev2_ring))
+
 struct context {
     struct harddoom2* hd2;
     struct hd2_buffer* curr_bufs[NUM_USER_BUFS];
-    struct doomdev2_cmd cmds[MAX_BATCH_CMDS];
+    /* Limits of commands using curr_bufs, updated together with them. */
+    struct bind_limits limits;
     struct mutex mut;
+
+    /* Submission ring shared with the user, installed (only once) by the first mmap. mmap runs under
+       mmap_lock, which the paths holding 'mut' take when they fault on user memory, so it doesn't take 'mut'. */
+    struct doomdev2_ring* ring;
+    /* Our own copy of ring->head; the user may scribble over the shared one. */
+    uint32_t ring_head;
+
+    /* Imported buffers, each holding a reference. Protected by 'mut'. */
+    struct idr handles;
+
+    /* Recorded command lists. Protected by 'mut'. */
+    struct idr lists;
+
+    /* Fence of the last batch sent by this context. */
+    counter last_fence;
+
+    /* Small writes held back to be sent together, see DOOMDEV2_IOCTL_SET_COALESCE. 'pending' is allocated
+       when coalescing is first enabled. Protected by 'mut' (num_pending is also read without it). */
+    uint32_t coalesce_ns;
+    struct doomdev2_cmd* pending;
+    size_t num_pending;
+    /* Flushes the pending commands after the delay. */
+    struct hrtimer flush_timer;
+    struct work_struct flush_work;
+    /* Registered with the device once coalescing is enabled. */
+    struct pending_flusher flusher;
+
+    /* Where harddoom2_write copies the commands it sends. Protected by 'mut'. */
+    struct doomdev2_cmd* staging;
+
+    /* How the context competes with others for the device. Changed only with 'mut' held,
+       which is also held while the context is sending. */
+    struct sched_entity sched;
+
+    /* Wakes up pollers of the context's file. */
+    wait_queue_head_t poll_wq;
+    struct fence_waiter poll_waiter;
 };
 
+static void signal_poll_waiter(struct fence_waiter* w) {
+    wake_up_all(&container_of(w, struct context, poll_waiter)->poll_wq);
+}
+
+/* Send the commands held back by coalescing. If 'nonblock' is set and the command buffer is full,
+   keeps the rest held back (the flush timer is still armed) and returns -EAGAIN. Returns 0 otherwise.
+   Must be called with ctx->mut held. */
+static int flush_pending(struct context* ctx, bool nonblock) {
+    size_t num_cmds = ctx->num_pending;
+    if (!num_cmds) {
+        return 0;
+    }
+
+    int err = 0;
+    size_t sent = 0;
+    while (sent < num_cmds) {
+        struct cmd_source src = { .kern_cmds = ctx->pending + sent, .num_cmds = num_cmds - sent };
+        counter fence;
+        ssize_t ret = harddoom2_write(ctx->hd2, ctx->curr_bufs, &ctx->limits, &src, ctx->staging,
+                &ctx->sched, nonblock, &fence);
+        if (ret == -EAGAIN) {
+            err = -EAGAIN;
+            break;
+        }
+        if (ret < 0) {
+            /* The commands were validated when they were written, only running out of memory gets here. */
+            DEBUG("flush_pending: dropping %lu cmds", num_cmds - sent);
+            sent = num_cmds;
+            break;
+        }
+
+        WRITE_ONCE(ctx->last_fence, fence);
+        sent += ret;
+    }
+
+    if (sent < num_cmds) {
+        memmove(ctx->pending, ctx->pending + sent, (num_cmds - sent) * sizeof(struct doomdev2_cmd));
+        WRITE_ONCE(ctx->num_pending, num_cmds - sent);
+    } else {
+        hrtimer_try_to_cancel(&ctx->flush_timer);
+        /* Only now, so that buffer users waiting for the flush see the buffers' new fences. */
+        smp_store_release(&ctx->num_pending, 0);
+        harddoom2_flush_done(ctx->hd2);
+    }
+
+    if (sent) {
+        wake_up_all(&ctx->poll_wq);
+    }
+    return err;
+}
+
+static void flush_work_fn(struct work_struct* work) {
+    struct context* ctx = container_of(work, struct context, flush_work);
+
+    mutex_lock(&ctx->mut);
+    flush_pending(ctx, false);
+    mutex_unlock(&ctx->mut);
+}
+
+static enum hrtimer_restart flush_timer_fn(struct hrtimer* timer) {
+    schedule_work(&container_of(timer, struct context, flush_timer)->flush_work);
+    return HRTIMER_NORESTART;
+}
+
+static bool flush_device_pending(struct pending_flusher* f) {
+    struct context* ctx = container_of(f, struct context, flusher);
+
+    if (!smp_load_acquire(&ctx->num_pending)) {
+        return false;
+    }
+    schedule_work(&ctx->flush_work);
+    return true;
+}
+
 static int context_open(struct inode* inode, struct file* file) {
     unsigned number = MINOR(inode->i_rdev);
     if (number >= DEVICES_LIMIT) {
@@ -40,8 +173,24 @@ static int context_open(struct inode* inode, struct file* file) {
         return -ENOMEM;
     }
 
+    ctx->staging = kvmalloc_array(MAX_WRITE_CMDS, sizeof(struct doomdev2_cmd), GFP_KERNEL);
+    if (!ctx->staging) {
+        DEBUG("ctx: staging kmalloc");
+        kfree(ctx);
+        return -ENOMEM;
+    }
+
     ctx->hd2 = get_hd2(number);
     mutex_init(&ctx->mut);
+    idr_init(&ctx->handles);
+    idr_init(&ctx->lists);
+    init_waitqueue_head(&ctx->poll_wq);
+    init_fence_waiter(&ctx->poll_waiter, signal_poll_waiter);
+    init_sched_entity(&ctx->sched);
+    hrtimer_init(&ctx->flush_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    ctx->flush_timer.function = flush_timer_fn;
+    INIT_WORK(&ctx->flush_work, flush_work_fn);
+    init_pending_flusher(&ctx->flusher, flush_device_pending);
 
     file->private_data = ctx;
 
@@ -51,46 +200,46 @@ static int context_open(struct inode* inode, struct file* file) {
 static int context_release(struct inode* inode, struct file* file) {
     struct context* ctx = (struct context*)file->private_data;
 
-    release_user_bufs(ctx->curr_bufs);
-
-    kfree(ctx);
-    return 0;
-}
+    /* Once nobody else can flush the context, send what's left. */
+    harddoom2_remove_flusher(ctx->hd2, &ctx->flusher);
+    hrtimer_cancel(&ctx->flush_timer);
+    cancel_work_sync(&ctx->flush_work);
+    mutex_lock(&ctx->mut);
+    flush_pending(ctx, false);
+    mutex_unlock(&ctx->mut);
+    kvfree(ctx->pending);
 
-static int setup(struct context* ctx, struct doomdev2_ioctl_setup __user* _params) {
-    struct doomdev2_ioctl_setup params;
+    cancel_fence_waiter(ctx->hd2, &ctx->poll_waiter);
+    release_user_bufs(ctx->curr_bufs);
 
-    if (copy_from_user(&params, _params, sizeof(struct doomdev2_ioctl_setup))) {
-        DEBUG("setup copy_from_user fail");
-        return -EFAULT;
+    struct hd2_buffer* buff;
+    int id;
+    idr_for_each_entry(&ctx->handles, buff, id) {
+        hd2_buff_put(buff);
     }
+    idr_destroy(&ctx->handles);
 
-    int32_t fds[NUM_USER_BUFS] = { params.surf_dst_fd, params.surf_src_fd, params.texture_fd,
-        params.flat_fd, params.translation_fd, params.colormap_fd, params.tranmap_fd };
-    struct hd2_buffer* bufs[NUM_USER_BUFS] = { NULL };
-
-    int err;
-    int i;
-    for (i = 0; i < NUM_USER_BUFS; ++i) {
-        if (fds[i] == -1) continue;
-
-        bufs[i] = hd2_buff_fd_get(fds[i]);
-        if (IS_ERR(bufs[i])) {
-            DEBUG("setup: wrong fd");
-            err = PTR_ERR(bufs[i]);
-            goto out_fds;
-        }
+    struct cmd_list* list;
+    idr_for_each_entry(&ctx->lists, list, id) {
+        harddoom2_free_list(list);
     }
+    idr_destroy(&ctx->lists);
 
-    err = -EINVAL;
+    vfree(ctx->ring);
+    kvfree(ctx->staging);
+    kfree(ctx);
+    return 0;
+}
 
+/* Check that 'bufs' make up a valid set of buffers for device 'hd2'. */
+static int check_bufs(struct harddoom2* hd2, struct hd2_buffer* bufs[NUM_USER_BUFS]) {
     int j;
     for (j = 0; j < 2; ++j) {
         if (!bufs[j]) continue;
 
         if (!is_surface(bufs[j])) {
             DEBUG("setup: non-surface given as surface");
-            goto out_fds;
+            return -EINVAL;
         }
     }
     for (; j < NUM_USER_BUFS; ++j) {
@@ -99,15 +248,15 @@ static int setup(struct context* ctx, struct doomdev2_ioctl_setup __user* _param
         BUG_ON(!get_buff_size(bufs[j]));
         if (is_surface(bufs[j])) {
             DEBUG("setup: surface given as non-surface");
-            goto out_fds;
+            return -EINVAL;
         }
     }
     for (j = 0; j < NUM_USER_BUFS; ++j) {
         if (!bufs[j]) continue;
 
-        if (!assigned_to(bufs[j], ctx->hd2)) {
+        if (!assigned_to(bufs[j], hd2)) {
             DEBUG("setup: wrong device");
-            goto out_fds;
+            return -EINVAL;
         }
     }
     if (bufs[DST_BUF_IDX] && bufs[SRC_BUF_IDX] &&
@@ -115,224 +264,345 @@ static int setup(struct context* ctx, struct doomdev2_ioctl_setup __user* _param
              get_buff_height(bufs[DST_BUF_IDX]) != get_buff_height(bufs[SRC_BUF_IDX]))) {
         /* The only command that uses the the source buffer, COPY_RECT, assumes they have the same dimensions. */
         DEBUG("setup: different dst and src buf dims");
-        goto out_fds;
+        return -EINVAL;
     }
     if (bufs[FLAT_BUF_IDX] && get_buff_size(bufs[FLAT_BUF_IDX]) % (1 << 12)) {
         DEBUG("setup: flat buf wrong size");
-        goto out_fds;
+        return -EINVAL;
     }
     if (bufs[TRANSLATE_BUF_IDX] && get_buff_size(bufs[TRANSLATE_BUF_IDX]) % (1 << 8)) {
         DEBUG("setup: translate buf wrong size");
-        goto out_fds;
+        return -EINVAL;
     }
     if (bufs[COLORMAP_BUF_IDX] && get_buff_size(bufs[COLORMAP_BUF_IDX]) % (1 << 8)) {
         DEBUG("setup: colormap buf wrong size");
-        goto out_fds;
+        return -EINVAL;
     }
     if (bufs[TRANMAP_BUF_IDX] && get_buff_size(bufs[TRANMAP_BUF_IDX]) % (1 << 16)) {
         DEBUG("setup: tranmap buf wrong size");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* Resolve the buffer fds in 'params' into 'bufs', taking a reference on each, and check them.
+   On failure no references are held. */
+static int get_fd_bufs(struct harddoom2* hd2, const struct doomdev2_ioctl_setup* params,
+        struct hd2_buffer* bufs[NUM_USER_BUFS]) {
+    int32_t fds[NUM_USER_BUFS] = { params->surf_dst_fd, params->surf_src_fd, params->texture_fd,
+        params->flat_fd, params->translation_fd, params->colormap_fd, params->tranmap_fd };
+
+    int err;
+    int i;
+    for (i = 0; i < NUM_USER_BUFS; ++i) {
+        bufs[i] = NULL;
+    }
+    for (i = 0; i < NUM_USER_BUFS; ++i) {
+        if (fds[i] == -1) continue;
+
+        struct hd2_buffer* buff = hd2_buff_fd_get(fds[i]);
+        if (IS_ERR(buff)) {
+            DEBUG("setup: wrong fd");
+            err = PTR_ERR(buff);
+            goto out_fds;
+        }
+        bufs[i] = buff;
+    }
+
+    if ((err = check_bufs(hd2, bufs))) {
         goto out_fds;
     }
 
-    mutex_lock(&ctx->mut);
-    for (j = 0; j < NUM_USER_BUFS; ++j) {
+    return 0;
+
+out_fds:
+    release_user_bufs(bufs);
+    return err;
+}
+
+/* Like get_fd_bufs, but resolves handles. Must be called with ctx->mut held. */
+static int get_handle_bufs(struct context* ctx, const struct doomdev2_ioctl_setup* params,
+        struct hd2_buffer* bufs[NUM_USER_BUFS]) {
+    int32_t handles[NUM_USER_BUFS] = { params->surf_dst_fd, params->surf_src_fd, params->texture_fd,
+        params->flat_fd, params->translation_fd, params->colormap_fd, params->tranmap_fd };
+
+    int i;
+    for (i = 0; i < NUM_USER_BUFS; ++i) {
+        bufs[i] = NULL;
+        if (handles[i] == -1) continue;
+
+        bufs[i] = handles[i] > 0 ? idr_find(&ctx->handles, handles[i]) : NULL;
+        if (!bufs[i]) {
+            DEBUG("setup: wrong handle");
+            return -EINVAL;
+        }
+    }
+
+    int err = check_bufs(ctx->hd2, bufs);
+    if (err) {
+        return err;
+    }
+
+    for (i = 0; i < NUM_USER_BUFS; ++i) {
+        if (bufs[i]) {
+            hd2_buff_get(bufs[i]);
+        }
+    }
+
+    return 0;
+}
+
+/* Replace the context's buffers with 'bufs', taking over their references.
+   Must be called with ctx->mut held. */
+static void set_bufs(struct context* ctx, struct hd2_buffer* bufs[NUM_USER_BUFS]) {
+    /* The pending commands were validated against the old buffers. */
+    flush_pending(ctx, false);
+    for (int j = 0; j < NUM_USER_BUFS; ++j) {
         hd2_buff_put(ctx->curr_bufs[j]);
         ctx->curr_bufs[j] = bufs[j];
     }
+    compute_bind_limits(&ctx->limits, ctx->curr_bufs);
+}
+
+static int setup(struct context* ctx, struct doomdev2_ioctl_setup __user* _params) {
+    struct doomdev2_ioctl_setup params;
+
+    if (copy_from_user(&params, _params, sizeof(struct doomdev2_ioctl_setup))) {
+        DEBUG("setup copy_from_user fail");
+        return -EFAULT;
+    }
+
+    struct hd2_buffer* bufs[NUM_USER_BUFS];
+    int err = get_fd_bufs(ctx->hd2, &params, bufs);
+    if (err) {
+        return err;
+    }
+
+    mutex_lock(&ctx->mut);
+    set_bufs(ctx, bufs);
     mutex_unlock(&ctx->mut);
 
     return 0;
+}
 
-out_fds:
-    for (--i; i >= 0; --i) {
-        hd2_buff_put(bufs[i]);
+static int setup_handles(struct context* ctx, struct doomdev2_ioctl_setup __user* _params) {
+    struct doomdev2_ioctl_setup params;
+
+    if (copy_from_user(&params, _params, sizeof(struct doomdev2_ioctl_setup))) {
+        DEBUG("setup_handles copy_from_user fail");
+        return -EFAULT;
     }
 
+    struct hd2_buffer* bufs[NUM_USER_BUFS];
+
+    mutex_lock(&ctx->mut);
+    int err = get_handle_bufs(ctx, &params, bufs);
+    if (!err) {
+        set_bufs(ctx, bufs);
+    }
+    mutex_unlock(&ctx->mut);
+
     return err;
 }
 
-static long context_ioctl(struct file* file, unsigned cmd, unsigned long arg) {
-    struct context* ctx = (struct context*)file->private_data;
+/* Returns the new handle or negative error code. */
+static int import_buffer(struct context* ctx, struct doomdev2_ioctl_import_buffer __user* _params) {
+    struct doomdev2_ioctl_import_buffer params;
 
-    switch (cmd) {
-    case DOOMDEV2_IOCTL_CREATE_SURFACE:
-        return harddoom2_create_surface(ctx->hd2, (struct doomdev2_ioctl_create_surface __user*)arg);
-    case DOOMDEV2_IOCTL_CREATE_BUFFER:
-        return harddoom2_create_buffer(ctx->hd2, (struct doomdev2_ioctl_create_buffer __user*)arg);
-    case DOOMDEV2_IOCTL_SETUP:
-        return setup(ctx, (struct doomdev2_ioctl_setup __user*)arg);
+    if (copy_from_user(&params, _params, sizeof(struct doomdev2_ioctl_import_buffer))) {
+        DEBUG("import copy_from_user fail");
+        return -EFAULT;
     }
 
-    return -ENOTTY;
-}
+    struct hd2_buffer* buff = hd2_buff_fd_get(params.fd);
+    if (IS_ERR(buff)) {
+        DEBUG("import: wrong fd");
+        return PTR_ERR(buff);
+    }
 
-static bool validate_maps(struct context* ctx, uint8_t flags, uint16_t colormap_idx, uint16_t translation_idx) {
-    if (flags & DOOMDEV2_CMD_FLAGS_TRANSLATE && !ctx->curr_bufs[TRANSLATE_BUF_IDX]) {
-        DEBUG("draw_column: translate flag set but no buf");
-        return false;
+    if (!assigned_to(buff, ctx->hd2)) {
+        DEBUG("import: wrong device");
+        hd2_buff_put(buff);
+        return -EINVAL;
     }
-    if (flags & DOOMDEV2_CMD_FLAGS_COLORMAP && !ctx->curr_bufs[COLORMAP_BUF_IDX]) {
-        DEBUG("draw_column: colormap flag set but no buf");
-        return false;
+
+    mutex_lock(&ctx->mut);
+    int handle = idr_alloc(&ctx->handles, buff, 1, 0, GFP_KERNEL);
+    mutex_unlock(&ctx->mut);
+
+    if (handle < 0) {
+        DEBUG("import: idr_alloc");
+        hd2_buff_put(buff);
     }
-    if (flags & DOOMDEV2_CMD_FLAGS_TRANMAP && !ctx->curr_bufs[TRANMAP_BUF_IDX]) {
-        DEBUG("draw_column: tranmap flag set but no buf");
-        return false;
+
+    return handle;
+}
+
+static int close_handle(struct context* ctx, unsigned long handle) {
+    mutex_lock(&ctx->mut);
+    struct hd2_buffer* buff = handle > 0 && handle <= INT_MAX ? idr_remove(&ctx->handles, handle) : NULL;
+    mutex_unlock(&ctx->mut);
+
+    if (!buff) {
+        DEBUG("close_handle: wrong handle");
+        return -EINVAL;
     }
-    if (flags & DOOMDEV2_CMD_FLAGS_TRANSLATE
-            && translation_idx >= (get_buff_size(ctx->curr_bufs[TRANSLATE_BUF_IDX]) >> 8)) {
-        DEBUG("draw_column: translation idx out of bounds");
-        return false;
+
+    /* The buffer stays alive while it is set in the context or used by the device. */
+    hd2_buff_put(buff);
+    return 0;
+}
+
+/* Send the commands in 'src' to the device, stopping before the first invalid one.
+   Returns the number of commands sent (which may be less than the length of the valid prefix
+   if there was not enough space in the command buffer) or negative error code.
+   Must be called with ctx->mut held and a dst surface set. */
+static ssize_t send_batch(struct context* ctx, const struct cmd_source* src, bool nonblock) {
+    ssize_t err;
+    if ((err = flush_pending(ctx, nonblock))) {
+        return err;
     }
-    if (flags & DOOMDEV2_CMD_FLAGS_COLORMAP
-            && colormap_idx >= (get_buff_size(ctx->curr_bufs[COLORMAP_BUF_IDX]) >> 8)) {
-        DEBUG("draw_column: colormap idx out of bounds");
-        return false;
+
+    counter fence;
+    ssize_t ret = harddoom2_write(ctx->hd2, ctx->curr_bufs, &ctx->limits, src, ctx->staging,
+            &ctx->sched, nonblock, &fence);
+    BUG_ON(!ret || ret > (ssize_t)src->num_cmds);
+
+    if (ret > 0) {
+        WRITE_ONCE(ctx->last_fence, fence);
     }
-    return true;
-}
 
-static bool validate_cmd(struct context* ctx, const struct doomdev2_cmd* user_cmd) {
-    BUG_ON(!ctx->curr_bufs[DST_BUF_IDX]);
+    return ret;
+}
 
-    struct hd2_buffer* dst_buff = ctx->curr_bufs[DST_BUF_IDX];
-    uint16_t surf_width = get_buff_width(dst_buff), surf_height = get_buff_height(dst_buff);
-    {
-        struct hd2_buffer* src_buff = ctx->curr_bufs[SRC_BUF_IDX];
-        BUG_ON(src_buff && (get_buff_width(src_buff) != surf_width || get_buff_height(src_buff) != surf_height));
+/* Send all of 'list'. Only waiting for the first batch can be avoided with O_NONBLOCK.
+   Returns the number of commands sent or negative error code if none were. Must be called with ctx->mut held. */
+static ssize_t send_list(struct context* ctx, const struct cmd_list* list, bool nonblock) {
+    ssize_t err;
+    if ((err = flush_pending(ctx, nonblock))) {
+        return err;
     }
 
-    switch (user_cmd->type) {
-    case DOOMDEV2_CMD_TYPE_COPY_RECT: {
-        if (!ctx->curr_bufs[SRC_BUF_IDX]) {
-            DEBUG("copy rect: no src buf");
-            return false;
-        }
+    size_t num_cmds = list_length(list);
+    size_t sent = 0;
 
-        const struct doomdev2_cmd_copy_rect* cmd = &user_cmd->copy_rect;
-        if ((uint32_t)cmd->pos_dst_x + cmd->width > surf_width ||
-                (uint32_t)cmd->pos_dst_y + cmd->height > surf_height ||
-                (uint32_t)cmd->pos_src_x + cmd->width > surf_width ||
-                (uint32_t)cmd->pos_src_y + cmd->height > surf_height) {
-            DEBUG("copy_rect: out of bounds");
-            return false;
+    while (sent < num_cmds) {
+        counter fence;
+        err = harddoom2_write_list(ctx->hd2, ctx->curr_bufs, &ctx->limits, list, sent,
+                &ctx->sched, nonblock && !sent, &fence);
+        if (err < 0) {
+            break;
         }
 
-        if (ctx->curr_bufs[DST_BUF_IDX] == ctx->curr_bufs[SRC_BUF_IDX] &&
-               cmd->pos_dst_x < cmd->pos_src_x + cmd->width && cmd->pos_dst_x + cmd->width > cmd->pos_src_x &&
-               cmd->pos_dst_y < cmd->pos_src_y + cmd->height && cmd->pos_dst_y + cmd->height > cmd->pos_src_y) {
-            DEBUG("copy_rect: intersection");
-            return false;
-        }
-        return true;
+        WRITE_ONCE(ctx->last_fence, fence);
+        sent += err;
     }
-    case DOOMDEV2_CMD_TYPE_FILL_RECT: {
-        const struct doomdev2_cmd_fill_rect* cmd = &user_cmd->fill_rect;
-        if ((uint32_t)cmd->pos_x + cmd->width > surf_width || (uint32_t)cmd->pos_y + cmd->height > surf_height) {
-            DEBUG("fill_rect: out of bounds");
-            return false;
-        }
-        return true;
-    }
-    case DOOMDEV2_CMD_TYPE_DRAW_LINE: {
-        const struct doomdev2_cmd_draw_line* cmd = &user_cmd->draw_line;
-        if (cmd->pos_a_x >= surf_width || cmd->pos_a_y >= surf_height
-                || cmd->pos_b_x >= surf_width || cmd->pos_b_y >= surf_height) {
-            DEBUG("draw_line: out of bounds");
-            return false;
-        }
-        return true;
+
+    if (sent) {
+        return sent;
     }
-    case DOOMDEV2_CMD_TYPE_DRAW_BACKGROUND: {
-        if (!ctx->curr_bufs[FLAT_BUF_IDX]) {
-            DEBUG("draw background: no flat buf");
-            return false;
-        }
+    return err;
+}
 
-        const struct doomdev2_cmd_draw_background* cmd = &user_cmd->draw_background;
-        if ((uint32_t)cmd->pos_x + cmd->width > surf_width || (uint32_t)cmd->pos_y + cmd->height > surf_height) {
-            DEBUG("draw background: out of bounds");
-            return false;
-        }
-        if (cmd->flat_idx >= (get_buff_size(ctx->curr_bufs[FLAT_BUF_IDX]) >> 12)) {
-            DEBUG("draw background: flat idx out of bounds");
-            return false;
-        }
-        return true;
+/* Validate and encode a large chunk of commands on several CPUs, then send it.
+   Returns the number of commands sent or negative error code if none were. Must be called with ctx->mut held. */
+static ssize_t send_large(struct context* ctx, const struct doomdev2_cmd __user* cmds, size_t num_cmds,
+        bool relaxed, bool nonblock) {
+    struct cmd_source src = { .user_cmds = cmds, .num_cmds = num_cmds, .relaxed = relaxed };
+    struct cmd_list* list = harddoom2_record_list(&ctx->limits, &src, true);
+    if (IS_ERR(list)) {
+        return PTR_ERR(list);
     }
-    case DOOMDEV2_CMD_TYPE_DRAW_COLUMN: {
-        if (!ctx->curr_bufs[TEXTURE_BUF_IDX]) {
-            DEBUG("draw_column: no texture buffer");
-            return false;
-        }
 
-        const struct doomdev2_cmd_draw_column* cmd = &user_cmd->draw_column;
-        if (cmd->pos_x >= surf_width || cmd->pos_b_y >= surf_height) {
-            DEBUG("draw_column: out of bounds");
-            return false;
-        }
-        if (cmd->pos_b_y < cmd->pos_a_y) {
-            DEBUG("draw_column: b_y < a_y");
-            return false;
-        }
-        if (!validate_maps(ctx, cmd->flags, cmd->colormap_idx, cmd->translation_idx)) {
-            return false;
-        }
-        return true;
+    ssize_t ret = send_list(ctx, list, nonblock);
+    harddoom2_free_list(list);
+    return ret;
+}
+
+/* Send 'num_cmds' commands from user memory to the device, reordering or culling them as the
+   DOOMDEV2_SUBMIT_BATCH_* 'flags' allow. Returns the number of commands sent or negative error code
+   if none were. Must be called with ctx->mut held. */
+static ssize_t write_cmds(struct context* ctx, const struct doomdev2_cmd __user* cmds, size_t num_cmds,
+        uint32_t flags, bool nonblock) {
+    bool relaxed = flags & DOOMDEV2_SUBMIT_BATCH_RELAXED;
+    bool cull = flags & DOOMDEV2_SUBMIT_BATCH_CULL;
+
+    if (!ctx->curr_bufs[DST_BUF_IDX]) {
+        DEBUG("write: no dst surface set");
+        return -EINVAL;
     }
-    case DOOMDEV2_CMD_TYPE_DRAW_SPAN: {
-        if (!ctx->curr_bufs[FLAT_BUF_IDX]) {
-            DEBUG("draw span: no flat buffer");
-            return false;
-        }
 
-        const struct doomdev2_cmd_draw_span* cmd = &user_cmd->draw_span;
-        if (cmd->pos_y >= surf_height || cmd->pos_b_x >= surf_width) {
-            DEBUG("draw span: out of bounds");
-            return false;
-        }
-        if (cmd->pos_b_x < cmd->pos_a_x) {
-            DEBUG("draw span: b_x < a_x");
-            return false;
-        }
-        if (cmd->flat_idx >= (get_buff_size(ctx->curr_bufs[FLAT_BUF_IDX]) >> 12)) {
-            DEBUG("draw span: flat idx out of bounds");
-            return false;
+    ssize_t err = 0;
+    size_t cmds_written = 0;
+
+    while (num_cmds) {
+        /* Recorded lists keep every command in its place, culling needs a plain batch. */
+        if (num_cmds >= LARGE_WRITE_CMDS && !cull) {
+            err = send_large(ctx, cmds, num_cmds < MAX_LIST_CMDS ? num_cmds : MAX_LIST_CMDS, relaxed, nonblock);
+        } else {
+            struct cmd_source src = {
+                .user_cmds = cmds,
+                .num_cmds = num_cmds < MAX_BATCH_CMDS ? num_cmds : MAX_BATCH_CMDS,
+                .relaxed = relaxed,
+                .cull = cull,
+            };
+            err = send_batch(ctx, &src, nonblock);
         }
-        if (!validate_maps(ctx, cmd->flags, cmd->colormap_idx, cmd->translation_idx)) {
-            return false;
+        if (err < 0) {
+            break;
         }
-        return true;
+
+        /* If a command in the middle of the batch was invalid, the next iteration will fail on it. */
+        cmds_written += err;
+        num_cmds -= err;
+        cmds += err;
     }
-    case DOOMDEV2_CMD_TYPE_DRAW_FUZZ: {
-        if (!ctx->curr_bufs[COLORMAP_BUF_IDX]) {
-            DEBUG("draw fuzz: no colormap");
-            return false;
-        }
 
-        const struct doomdev2_cmd_draw_fuzz* cmd = &user_cmd->draw_fuzz;
-        if (cmd->pos_x >= surf_width || cmd->fuzz_end >= surf_height) {
-            DEBUG("draw fuzz: out of bounds");
-            return false;
-        }
-        if (cmd->fuzz_start > cmd->pos_a_y || cmd->pos_a_y > cmd->pos_b_y || cmd->pos_b_y > cmd->fuzz_end) {
-            DEBUG("draw fuzz: inequalities");
-            return false;
-        }
-        if (cmd->colormap_idx >= (get_buff_size(ctx->curr_bufs[COLORMAP_BUF_IDX]) >> 8)) {
-            DEBUG("draw fuzz: colormap idx out of bounds");
-            return false;
-        }
-        if (cmd->fuzz_pos > 55) {
-            DEBUG("draw fuzz: fuzz_pos > 55");
-            return false;
-        }
-        return true;
+    if (cmds_written) {
+        return cmds_written;
+    } else {
+        BUG_ON(!err);
+        return err;
     }
+}
+
+/* Validate the commands and add them to the pending ones, flushing them if there's enough.
+   With 'nonblock', flushing doesn't wait for space in the command buffer (what doesn't fit waits for the timer).
+   Returns the number of commands added or negative error code if there were none.
+   Must be called with ctx->mut held and coalescing enabled. */
+static ssize_t append_pending(struct context* ctx, const struct doomdev2_cmd __user* cmds, size_t num_cmds,
+        bool nonblock) {
+    if (!ctx->curr_bufs[DST_BUF_IDX]) {
+        DEBUG("append_pending: no dst surface set");
+        return -EINVAL;
+    }
+
+    ssize_t err;
+    if (ctx->num_pending + num_cmds > COALESCE_CMDS && (err = flush_pending(ctx, nonblock))
+            && ctx->num_pending + num_cmds > COALESCE_CMDS) {
+        return err;
     }
 
-    DEBUG("unknown cmd type: %u", user_cmd->type);
-    return false;
+    struct doomdev2_cmd* tail = ctx->pending + ctx->num_pending;
+    if (copy_from_user(tail, cmds, num_cmds * sizeof(struct doomdev2_cmd))) {
+        DEBUG("append_pending: copy_from_user fail");
+        return -EFAULT;
+    }
+    size_t num_valid = validate_cmds(&ctx->limits, tail, num_cmds);
+    if (!num_valid) {
+        return -EINVAL;
+    }
+
+    if (!ctx->num_pending) {
+        hrtimer_start(&ctx->flush_timer, ns_to_ktime(ctx->coalesce_ns), HRTIMER_MODE_REL);
+    }
+    WRITE_ONCE(ctx->num_pending, ctx->num_pending + num_valid);
+
+    if (ctx->num_pending == COALESCE_CMDS) {
+        flush_pending(ctx, nonblock);
+    }
+    return num_valid;
 }
 
 static ssize_t context_write(struct file* file, const char __user* _buf, size_t count, loff_t* off) {
@@ -349,70 +619,532 @@ static ssize_t context_write(struct file* file, const char __user* _buf, size_t
 
     struct context* ctx = (struct context*)file->private_data;
 
-    int err = 0;
-    size_t cmds_written = 0;
+    mutex_lock(&ctx->mut);
+    ssize_t ret;
+    if (ctx->coalesce_ns && num_cmds <= COALESCE_WRITE_CMDS) {
+        ret = append_pending(ctx, (const struct doomdev2_cmd __user*)_buf, num_cmds, file->f_flags & O_NONBLOCK);
+    } else {
+        ret = write_cmds(ctx, (const struct doomdev2_cmd __user*)_buf, num_cmds, 0, file->f_flags & O_NONBLOCK);
+    }
+    mutex_unlock(&ctx->mut);
+
+    if (ret < 0) {
+        return ret;
+    }
+    return ret * sizeof(struct doomdev2_cmd);
+}
+
+/* Expand a compact run of columns and send it, one batch of up to MAX_BATCH_CMDS columns at a time.
+   Returns the number of columns sent or negative error code if none were. */
+static long draw_columns(struct context* ctx, struct doomdev2_ioctl_draw_columns __user* _params, bool nonblock) {
+    struct doomdev2_ioctl_draw_columns params;
+    long err = 0;
+    size_t sent = 0;
+
+    if (copy_from_user(&params, _params, sizeof(struct doomdev2_ioctl_draw_columns))) {
+        DEBUG("draw_columns copy_from_user fail");
+        return -EFAULT;
+    }
+    if (!params.num_cmds || !params.data_size || params.data_size > DOOMDEV2_MAX_COLUMNS_SIZE) {
+        DEBUG("draw_columns: wrong size");
+        return -EINVAL;
+    }
+    if (params.base._pad || params.base._pad2) {
+        DEBUG("draw_columns: nonzero padding");
+        return -EINVAL;
+    }
+
+    /* Only the compact stream comes from the user; the commands are expanded in the kernel. */
+    uint8_t* data = vmemdup_user((const void __user*)params.data_ptr, params.data_size);
+    if (IS_ERR(data)) {
+        DEBUG("draw_columns: vmemdup_user");
+        return PTR_ERR(data);
+    }
+    struct doomdev2_cmd* cmds = kvmalloc_array(MAX_BATCH_CMDS, sizeof(struct doomdev2_cmd), GFP_KERNEL);
+    if (!cmds) {
+        DEBUG("draw_columns: kvmalloc");
+        err = -ENOMEM;
+        goto out_data;
+    }
+
+    struct column_decoder dec;
+    init_column_decoder(&dec, &params.base, data, params.data_size, params.num_cmds);
 
     mutex_lock(&ctx->mut);
     if (!ctx->curr_bufs[DST_BUF_IDX]) {
-        DEBUG("write: no dst surface set");
+        DEBUG("draw_columns: no dst surface set");
         err = -EINVAL;
-        goto out_surf;
+        goto out_unlock;
     }
 
-    size_t num_batch = MAX_BATCH_CMDS;
-    while (num_cmds) {
-        if (num_batch > num_cmds) {
-            /* Last batch. */
-            num_batch = num_cmds;
+    for (;;) {
+        ssize_t num_cmds = decode_columns(&dec, cmds, MAX_BATCH_CMDS);
+        if (num_cmds <= 0) {
+            err = num_cmds;
+            break;
         }
 
-        if (copy_from_user(ctx->cmds, _buf, num_batch * sizeof(struct doomdev2_cmd))) {
-            DEBUG("context_write: copy from user fail");
-            err = -EFAULT;
+        size_t chunk_sent = 0;
+        while (chunk_sent < num_cmds) {
+            struct cmd_source src = { .kern_cmds = cmds + chunk_sent, .num_cmds = num_cmds - chunk_sent };
+            err = send_batch(ctx, &src, nonblock);
+            if (err < 0) {
+                goto out_unlock;
+            }
+            chunk_sent += err;
+            sent += err;
+        }
+    }
+
+out_unlock:
+    mutex_unlock(&ctx->mut);
+    kvfree(cmds);
+out_data:
+    kvfree(data);
+
+    if (sent) {
+        return sent;
+    }
+    return err;
+}
+
+/* Like context_write, for writev and, through iter_file_splice_write, for splice and sendfile.
+   Those hand over page cache or pipe pages, which are read straight into the command buffer.
+   Commands may be split between calls: only whole ones are consumed. */
+static ssize_t context_write_iter(struct kiocb* iocb, struct iov_iter* from) {
+    struct context* ctx = (struct context*)iocb->ki_filp->private_data;
+    bool nonblock = (iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK);
+
+    /* Less than a command left is the start of one the next call completes; a short write() is
+       rejected by context_write. */
+    size_t num_cmds = iov_iter_count(from) / sizeof(struct doomdev2_cmd);
+    if (!num_cmds) {
+        return 0;
+    }
+    if (num_cmds > MAX_CMDS) {
+        num_cmds = MAX_CMDS;
+    }
+
+    ssize_t err = 0;
+    size_t sent = 0;
+
+    mutex_lock(&ctx->mut);
+    if (!ctx->curr_bufs[DST_BUF_IDX]) {
+        DEBUG("context_write_iter: no dst surface set");
+        err = -EINVAL;
+        goto out;
+    }
+
+    while (sent < num_cmds) {
+        struct cmd_source src = {
+            .iter = from,
+            .num_cmds = min_t(size_t, num_cmds - sent, MAX_BATCH_CMDS),
+        };
+
+        err = send_batch(ctx, &src, nonblock);
+        if (err < 0) {
             break;
         }
 
-        size_t it;
-        for (it = 0; it < num_batch; ++it) {
-            if (!validate_cmd(ctx, &ctx->cmds[it])) {
-                break;
-            }
+        iov_iter_advance(from, err * sizeof(struct doomdev2_cmd));
+        sent += err;
+    }
+
+out:
+    mutex_unlock(&ctx->mut);
+
+    if (sent) {
+        return sent * sizeof(struct doomdev2_cmd);
+    }
+    return err;
+}
+
+/* Send a sequence of batches, each with its own set of buffers.
+   Returns the number of batches sent in full, with the number of commands sent from the next one
+   in 'partial_cmds', or negative error code if no command was sent.
+   The context is left with the buffers of the last batch that was started. */
+static long submit(struct context* ctx, struct doomdev2_ioctl_submit __user* _params, bool nonblock) {
+    struct doomdev2_ioctl_submit params;
+
+    if (copy_from_user(&params, _params, sizeof(struct doomdev2_ioctl_submit))) {
+        DEBUG("submit copy_from_user fail");
+        return -EFAULT;
+    }
+
+    const struct doomdev2_submit_batch __user* batches = u64_to_user_ptr(params.batches_ptr);
+
+    long err = 0;
+    uint32_t done;
+    size_t partial = 0;
+    for (done = 0; done < params.num_batches; ++done) {
+        struct doomdev2_submit_batch batch;
+        if (copy_from_user(&batch, &batches[done], sizeof(struct doomdev2_submit_batch))) {
+            DEBUG("submit: batch copy_from_user fail");
+            err = -EFAULT;
+            break;
         }
 
-        if (!it) {
-            /* The first command in this batch was invalid. */
+        if (batch.flags & ~DOOMDEV2_SUBMIT_BATCH_FLAGS || !batch.num_cmds || batch._pad) {
+            DEBUG("submit: wrong flags, empty batch or nonzero padding");
             err = -EINVAL;
             break;
         }
 
-        err = harddoom2_write(ctx->hd2, ctx->curr_bufs, ctx->cmds, it);
+        const struct doomdev2_cmd __user* cmds = u64_to_user_ptr(batch.cmds_ptr);
+        size_t sent = 0;
 
-        if (err < 0) {
+        struct hd2_buffer* bufs[NUM_USER_BUFS];
+        mutex_lock(&ctx->mut);
+        if (batch.flags & DOOMDEV2_SUBMIT_BATCH_HANDLES) {
+            err = get_handle_bufs(ctx, &batch.bufs, bufs);
+        } else {
+            err = get_fd_bufs(ctx->hd2, &batch.bufs, bufs);
+        }
+        if (err) {
+            mutex_unlock(&ctx->mut);
             break;
         }
 
-        BUG_ON(!err || err > it);
-        cmds_written += err;
+        set_bufs(ctx, bufs);
+        while (sent < batch.num_cmds) {
+            /* write_cmds stops early only on error, so retrying reports the error. */
+            err = write_cmds(ctx, cmds + sent, batch.num_cmds - sent, batch.flags, nonblock);
+            if (err < 0) {
+                break;
+            }
+            sent += err;
+        }
+        mutex_unlock(&ctx->mut);
 
-        if (it < num_batch) {
-            /* One of the middle commands was invalid. */
+        if (err < 0) {
+            partial = sent;
             break;
         }
+    }
+
+    if (done || partial) {
+        if (put_user(READ_ONCE(ctx->last_fence), &_params->fence)
+                || put_user((uint32_t)partial, &_params->partial_cmds)) {
+            DEBUG("submit: put_user fail");
+        }
+        return done;
+    }
+    return err;
+}
 
-        /* The whole batch was successfuly written. */
-        num_cmds -= num_batch;
-        _buf += num_batch * sizeof(struct doomdev2_cmd);
+static long fence_eventfd(struct context* ctx, struct doomdev2_ioctl_fence_eventfd __user* _params) {
+    struct doomdev2_ioctl_fence_eventfd params;
+
+    if (copy_from_user(&params, _params, sizeof(struct doomdev2_ioctl_fence_eventfd))) {
+        DEBUG("fence_eventfd copy_from_user fail");
+        return -EFAULT;
+    }
+    if (params._pad) {
+        DEBUG("fence_eventfd: nonzero padding");
+        return -EINVAL;
     }
 
-out_surf:
+    return harddoom2_fence_eventfd(ctx->hd2, params.fence, params.eventfd);
+}
+
+/* Returns the new list handle or negative error code. */
+static int record_list(struct context* ctx, struct doomdev2_ioctl_record_list __user* _params) {
+    struct doomdev2_ioctl_record_list params;
+
+    if (copy_from_user(&params, _params, sizeof(struct doomdev2_ioctl_record_list))) {
+        DEBUG("record_list copy_from_user fail");
+        return -EFAULT;
+    }
+    if (params._pad) {
+        DEBUG("record_list: nonzero padding");
+        return -EINVAL;
+    }
+
+    struct cmd_source src = {
+        .user_cmds = (const struct doomdev2_cmd __user*)params.cmds_ptr,
+        .num_cmds = params.num_cmds,
+    };
+
+    int handle;
+    mutex_lock(&ctx->mut);
+    if (!ctx->curr_bufs[DST_BUF_IDX]) {
+        DEBUG("record_list: no dst surface set");
+        handle = -EINVAL;
+        goto out;
+    }
+
+    struct cmd_list* list = harddoom2_record_list(&ctx->limits, &src, false);
+    if (IS_ERR(list)) {
+        handle = PTR_ERR(list);
+        goto out;
+    }
+
+    handle = idr_alloc(&ctx->lists, list, 1, 0, GFP_KERNEL);
+    if (handle < 0) {
+        DEBUG("record_list: idr_alloc");
+        harddoom2_free_list(list);
+    }
+
+out:
     mutex_unlock(&ctx->mut);
+    return handle;
+}
 
-    if (cmds_written) {
-        return cmds_written * sizeof(struct doomdev2_cmd);
+/* Send the whole list. Only waiting for the first batch can be avoided with O_NONBLOCK, so that
+   the list is never cut in half. Returns the number of commands sent or negative error code. */
+static long execute_list(struct context* ctx, unsigned long handle, bool nonblock) {
+    long err;
+
+    mutex_lock(&ctx->mut);
+    struct cmd_list* list = handle > 0 && handle <= INT_MAX ? idr_find(&ctx->lists, handle) : NULL;
+    if (!list) {
+        DEBUG("execute_list: wrong handle");
+        err = -EINVAL;
+        goto out;
+    }
+
+    err = send_list(ctx, list, nonblock);
+
+out:
+    mutex_unlock(&ctx->mut);
+    return err;
+}
+
+static int destroy_list(struct context* ctx, unsigned long handle) {
+    mutex_lock(&ctx->mut);
+    struct cmd_list* list = handle > 0 && handle <= INT_MAX ? idr_remove(&ctx->lists, handle) : NULL;
+    mutex_unlock(&ctx->mut);
+
+    if (!list) {
+        DEBUG("destroy_list: wrong handle");
+        return -EINVAL;
+    }
+
+    harddoom2_free_list(list);
+    return 0;
+}
+
+static int set_coalesce(struct context* ctx, struct doomdev2_ioctl_set_coalesce __user* _params) {
+    struct doomdev2_ioctl_set_coalesce params;
+
+    if (copy_from_user(&params, _params, sizeof(struct doomdev2_ioctl_set_coalesce))) {
+        DEBUG("set_coalesce copy_from_user fail");
+        return -EFAULT;
+    }
+
+    if (params.delay_us > DOOMDEV2_COALESCE_MAX_DELAY_US) {
+        DEBUG("set_coalesce: delay too long");
+        return -EINVAL;
+    }
+
+    int err = 0;
+    mutex_lock(&ctx->mut);
+    if (params.delay_us && !ctx->pending) {
+        ctx->pending = kvmalloc_array(COALESCE_CMDS, sizeof(struct doomdev2_cmd), GFP_KERNEL);
+        if (!ctx->pending) {
+            DEBUG("set_coalesce: kvmalloc");
+            err = -ENOMEM;
+            goto out_remove;
+        }
+    }
+    /* Buffer reads and writes flush the pending commands only while the context is registered. */
+    if (params.delay_us) {
+        harddoom2_add_flusher(ctx->hd2, &ctx->flusher);
     } else {
-        BUG_ON(!err);
-        return err;
+        flush_pending(ctx, false);
+        harddoom2_remove_flusher(ctx->hd2, &ctx->flusher);
     }
+    ctx->coalesce_ns = params.delay_us * NSEC_PER_USEC;
+    mutex_unlock(&ctx->mut);
+    return 0;
+
+out_remove:
+    harddoom2_remove_flusher(ctx->hd2, &ctx->flusher);
+    mutex_unlock(&ctx->mut);
+    return err;
+}
+
+/* Flushes the pending commands, so that the fence covers them. */
+static long get_fence(struct context* ctx, uint64_t __user* _fence) {
+    mutex_lock(&ctx->mut);
+    flush_pending(ctx, false);
+    mutex_unlock(&ctx->mut);
+
+    return put_user(READ_ONCE(ctx->last_fence), _fence);
+}
+
+static long set_sched(struct context* ctx, struct doomdev2_ioctl_set_sched __user* _params) {
+    struct doomdev2_ioctl_set_sched params;
+
+    if (copy_from_user(&params, _params, sizeof(struct doomdev2_ioctl_set_sched))) {
+        DEBUG("set_sched copy_from_user fail");
+        return -EFAULT;
+    }
+
+    if (params.priority > DOOMDEV2_PRIORITY_INTERACTIVE || !params.weight || params.weight > DOOMDEV2_WEIGHT_MAX) {
+        DEBUG("set_sched: invalid params");
+        return -EINVAL;
+    }
+    /* Same rule as for raising the nice level of a process. */
+    if (params.priority > DOOMDEV2_PRIORITY_NORMAL && !capable(CAP_SYS_NICE)) {
+        DEBUG("set_sched: not permitted");
+        return -EPERM;
+    }
+
+    mutex_lock(&ctx->mut);
+    ctx->sched.priority = params.priority;
+    ctx->sched.weight = params.weight;
+    mutex_unlock(&ctx->mut);
+
+    return 0;
+}
+
+/* The context is readable once all of its batches have finished. */
+static __poll_t context_poll(struct file* file, poll_table* wait) {
+    struct context* ctx = (struct context*)file->private_data;
+
+    poll_wait(file, &ctx->poll_wq, wait);
+
+    /* flush_pending wakes us up once the held back commands have a fence. */
+    if (READ_ONCE(ctx->num_pending)) {
+        schedule_work(&ctx->flush_work);
+        return 0;
+    }
+
+    counter last_fence = READ_ONCE(ctx->last_fence);
+    if (fence_cnt_passed(ctx->hd2, last_fence)) {
+        return EPOLLIN | EPOLLRDNORM;
+    }
+
+    arm_fence_waiter(ctx->hd2, &ctx->poll_waiter, last_fence);
+    return 0;
+}
+
+/* Send the commands the user has put in the shared ring since the last doorbell.
+   Returns the number of commands consumed or negative error code if none were. */
+static long ring_doorbell(struct context* ctx, bool nonblock) {
+    struct doomdev2_ring* ring;
+    long err = 0;
+    long consumed = 0;
+
+    mutex_lock(&ctx->mut);
+    ring = smp_load_acquire(&ctx->ring);
+    if (!ring) {
+        DEBUG("doorbell: ring not mapped");
+        err = -EINVAL;
+        goto out;
+    }
+    if (!ctx->curr_bufs[DST_BUF_IDX]) {
+        DEBUG("doorbell: no dst surface set");
+        err = -EINVAL;
+        goto out;
+    }
+
+    uint32_t tail = READ_ONCE(ring->tail);
+    if (tail >= DOOMDEV2_RING_CMDS) {
+        DEBUG("doorbell: tail out of bounds");
+        err = -EINVAL;
+        goto out;
+    }
+
+    while (ctx->ring_head != tail) {
+        uint32_t head = ctx->ring_head;
+        /* Don't wrap around inside a single batch. */
+        size_t num_batch = (tail > head ? tail : DOOMDEV2_RING_CMDS) - head;
+        if (num_batch > MAX_BATCH_CMDS) {
+            num_batch = MAX_BATCH_CMDS;
+        }
+
+        /* harddoom2_write copies the commands before validating them, the user can't change them under us. */
+        struct cmd_source src = { .kern_cmds = &ring->cmds[head], .num_cmds = num_batch };
+
+        err = send_batch(ctx, &src, nonblock);
+        if (err < 0) {
+            break;
+        }
+
+        consumed += err;
+        ctx->ring_head = (head + err) % DOOMDEV2_RING_CMDS;
+        WRITE_ONCE(ring->head, ctx->ring_head);
+    }
+
+out:
+    mutex_unlock(&ctx->mut);
+
+    if (consumed) {
+        return consumed;
+    }
+    return err;
+}
+
+static int context_mmap(struct file* file, struct vm_area_struct* vma) {
+    struct context* ctx = (struct context*)file->private_data;
+
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start != RING_MAP_SIZE) {
+        DEBUG("mmap: wrong offset or size");
+        return -EINVAL;
+    }
+
+    struct doomdev2_ring* ring = smp_load_acquire(&ctx->ring);
+    if (!ring) {
+        /* vmalloc_user zeroes the memory, so the ring starts empty, as ring_head does. */
+        struct doomdev2_ring* new_ring = vmalloc_user(RING_MAP_SIZE);
+        if (!new_ring) {
+            DEBUG("mmap: vmalloc_user");
+            return -ENOMEM;
+        }
+
+        /* Another mmap may have been first. The release pairs with the loads above and in ring_doorbell. */
+        ring = cmpxchg_release(&ctx->ring, NULL, new_ring);
+        if (ring) {
+            vfree(new_ring);
+        } else {
+            ring = new_ring;
+        }
+    }
+
+    return remap_vmalloc_range(vma, ring, 0);
+}
+
+static long context_ioctl(struct file* file, unsigned cmd, unsigned long arg) {
+    struct context* ctx = (struct context*)file->private_data;
+
+    switch (cmd) {
+    case DOOMDEV2_IOCTL_CREATE_SURFACE:
+        return harddoom2_create_surface(ctx->hd2, (struct doomdev2_ioctl_create_surface __user*)arg);
+    case DOOMDEV2_IOCTL_CREATE_BUFFER:
+        return harddoom2_create_buffer(ctx->hd2, (struct doomdev2_ioctl_create_buffer __user*)arg);
+    case DOOMDEV2_IOCTL_SETUP:
+        return setup(ctx, (struct doomdev2_ioctl_setup __user*)arg);
+    case DOOMDEV2_IOCTL_RING_DOORBELL:
+        return ring_doorbell(ctx, file->f_flags & O_NONBLOCK);
+    case DOOMDEV2_IOCTL_IMPORT_BUFFER:
+        return import_buffer(ctx, (struct doomdev2_ioctl_import_buffer __user*)arg);
+    case DOOMDEV2_IOCTL_CLOSE_HANDLE:
+        return close_handle(ctx, arg);
+    case DOOMDEV2_IOCTL_SETUP_HANDLES:
+        return setup_handles(ctx, (struct doomdev2_ioctl_setup __user*)arg);
+    case DOOMDEV2_IOCTL_SUBMIT:
+        return submit(ctx, (struct doomdev2_ioctl_submit __user*)arg, file->f_flags & O_NONBLOCK);
+    case DOOMDEV2_IOCTL_GET_FENCE:
+        return get_fence(ctx, (uint64_t __user*)arg);
+    case DOOMDEV2_IOCTL_FENCE_EVENTFD:
+        return fence_eventfd(ctx, (struct doomdev2_ioctl_fence_eventfd __user*)arg);
+    case DOOMDEV2_IOCTL_SET_SCHED:
+        return set_sched(ctx, (struct doomdev2_ioctl_set_sched __user*)arg);
+    case DOOMDEV2_IOCTL_RECORD_LIST:
+        return record_list(ctx, (struct doomdev2_ioctl_record_list __user*)arg);
+    case DOOMDEV2_IOCTL_EXECUTE_LIST:
+        return execute_list(ctx, arg, file->f_flags & O_NONBLOCK);
+    case DOOMDEV2_IOCTL_DESTROY_LIST:
+        return destroy_list(ctx, arg);
+    case DOOMDEV2_IOCTL_DRAW_COLUMNS:
+        return draw_columns(ctx, (struct doomdev2_ioctl_draw_columns __user*)arg, file->f_flags & O_NONBLOCK);
+    case DOOMDEV2_IOCTL_SET_COALESCE:
+        return set_coalesce(ctx, (struct doomdev2_ioctl_set_coalesce __user*)arg);
+    }
+
+    return -ENOTTY;
 }
 
 const struct file_operations _context_ops = {
@@ -421,7 +1153,11 @@ const struct file_operations _context_ops = {
     .release = context_release,
     .unlocked_ioctl = context_ioctl,
     .compat_ioctl = context_ioctl,
-    .write = context_write
+    .write = context_write,
+    .write_iter = context_write_iter,
+    .splice_write = iter_file_splice_write,
+    .poll = context_poll,
+    .mmap = context_mmap
 };
 
 const struct file_operations* const context_ops = &_context_ops;
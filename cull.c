@@ -0,0 +1,95 @@
+#include <linux/kernel.h>
+
+#include "doomdev2.h"
+
+#include "common.h"
+#include "region.h"
+#include "validate.h"
+
+#include "cull.h"
+
+/* Does the command write every pixel of its destination rectangle, without looking at what was there? */
+static bool opaque(const struct bind_limits* limits, const struct doomdev2_cmd* cmd) {
+    switch (cmd->type) {
+    case DOOMDEV2_CMD_TYPE_COPY_RECT:
+        return !limits->src_is_dst;
+    case DOOMDEV2_CMD_TYPE_FILL_RECT:
+    case DOOMDEV2_CMD_TYPE_DRAW_BACKGROUND:
+        return true;
+    case DOOMDEV2_CMD_TYPE_DRAW_COLUMN:
+        return !(cmd->draw_column.flags & DOOMDEV2_CMD_FLAGS_TRANMAP);
+    case DOOMDEV2_CMD_TYPE_DRAW_SPAN:
+        return !(cmd->draw_span.flags & DOOMDEV2_CMD_FLAGS_TRANMAP);
+    default:
+        /* A line covers only a part of its rectangle, fuzz reads the destination. */
+        return false;
+    }
+}
+
+/* Does the command read the destination surface? Earlier writes can't be dropped then. */
+static bool reads_dst(const struct bind_limits* limits, const struct doomdev2_cmd* cmd) {
+    switch (cmd->type) {
+    case DOOMDEV2_CMD_TYPE_COPY_RECT:
+        return limits->src_is_dst;
+    case DOOMDEV2_CMD_TYPE_DRAW_COLUMN:
+        return cmd->draw_column.flags & DOOMDEV2_CMD_FLAGS_TRANMAP;
+    case DOOMDEV2_CMD_TYPE_DRAW_SPAN:
+        return cmd->draw_span.flags & DOOMDEV2_CMD_FLAGS_TRANMAP;
+    case DOOMDEV2_CMD_TYPE_DRAW_FUZZ:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool rect_contains(const struct rect* outer, const struct rect* inner) {
+    return outer->x0 <= inner->x0 && inner->x1 <= outer->x1 && outer->y0 <= inner->y0 && inner->y1 <= outer->y1;
+}
+
+static uint32_t cmd_pixels(const struct doomdev2_cmd* cmd, const struct rect* rect) {
+    uint32_t width = rect->x1 - rect->x0, height = rect->y1 - rect->y0;
+    return cmd->type == DOOMDEV2_CMD_TYPE_DRAW_LINE ? max(width, height) : width * height;
+}
+
+size_t cull_cmds(const struct bind_limits* limits, struct doomdev2_cmd* cmds, size_t num_cmds, uint64_t* culled) {
+    /* Opaque commands later than the one looked at, with nothing reading the destination in between. */
+    struct rect covers[CULL_WINDOW];
+    size_t num_covers = 0;
+    uint32_t dropped = 0;
+
+    BUG_ON(num_cmds > CULL_WINDOW);
+
+    for (size_t it = num_cmds; it-- > 0;) {
+        struct rect rect;
+        cmd_dst_rect(&cmds[it], &rect);
+
+        bool covered = false;
+        for (size_t i = 0; i < num_covers && !covered; ++i) {
+            covered = rect_contains(&covers[i], &rect);
+        }
+        if (covered) {
+            dropped |= BIT(it);
+            *culled += cmd_pixels(&cmds[it], &rect);
+            continue;
+        }
+
+        if (reads_dst(limits, &cmds[it])) {
+            num_covers = 0;
+        }
+        if (opaque(limits, &cmds[it])) {
+            covers[num_covers++] = rect;
+        }
+    }
+
+    if (!dropped) {
+        return num_cmds;
+    }
+
+    size_t num_kept = 0;
+    for (size_t it = 0; it < num_cmds; ++it) {
+        if (!(dropped & BIT(it))) {
+            cmds[num_kept++] = cmds[it];
+        }
+    }
+    return num_kept;
+}
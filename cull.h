@@ -0,0 +1,18 @@
+#ifndef CULL_H
+#define CULL_H
+
+#include <linux/types.h>
+
+#include "doomdev2.h"
+
+#include "validate.h"
+
+/* Most commands cull_cmds looks at together. */
+#define CULL_WINDOW 32
+
+/* Drop the commands whose destination a later opaque command overwrites completely before anything reads it
+   (see DOOMDEV2_SUBMIT_BATCH_CULL), moving the rest to the front in order. The commands have to be valid
+   against 'limits'. Returns the number of commands left and adds the pixels of the dropped ones to 'culled'. */
+size_t cull_cmds(const struct bind_limits* limits, struct doomdev2_cmd* cmds, size_t num_cmds, uint64_t* culled);
+
+#endif
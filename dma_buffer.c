@@ -2,6 +2,9 @@
 #include <linux/kernel.h>
 #include <linux/uaccess.h>
 #include <linux/pci.h>
+#include <linux/dma-mapping.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
 
 #include "harddoom2.h"
 #include "common.h"
@@ -9,6 +12,31 @@
 #include "dma_buffer.h"
 
 _Static_assert(LONG_MAX >= MAX_BUFFER_PAGES * HARDDOOM2_PAGE_SIZE && sizeof(ssize_t) == sizeof(long), "ssize_max");
+_Static_assert(HARDDOOM2_PAGE_SIZE == PAGE_SIZE, "device pages are mapped as kernel pages");
+
+/* Hand the bytes [pos, pos + size) of the buffer over to the device or to the CPU. */
+static void sync_range(const struct dma_buffer* buff, size_t pos, size_t size, bool for_device) {
+    BUG_ON(pos + size < pos || pos + size > buff->size);
+
+    while (size) {
+        size_t page = pos / HARDDOOM2_PAGE_SIZE;
+        size_t offset = pos % HARDDOOM2_PAGE_SIZE;
+        size_t len = min_t(size_t, size, HARDDOOM2_PAGE_SIZE - offset);
+
+        if (for_device) {
+            dma_sync_single_for_device(buff->dev, buff->pages_dev[page] + offset, len, DMA_BIDIRECTIONAL);
+        } else {
+            dma_sync_single_for_cpu(buff->dev, buff->pages_dev[page] + offset, len, DMA_BIDIRECTIONAL);
+        }
+
+        pos += len;
+        size -= len;
+    }
+}
+
+void sync_dma_buff_for_device(const struct dma_buffer* buff, size_t pos, size_t size) {
+    sync_range(buff, pos, size, true);
+}
 
 int init_dma_buff(struct dma_buffer* buff, size_t size, struct device* dev) {
     BUG_ON(size > MAX_BUFFER_PAGES * HARDDOOM2_PAGE_SIZE);
@@ -29,9 +57,16 @@ int init_dma_buff(struct dma_buffer* buff, size_t size, struct device* dev) {
 
     size_t page;
     for (page = 0; page < num_pages; ++page) {
-        buff->pages_kern[page] = dma_alloc_coherent(dev, HARDDOOM2_PAGE_SIZE, &buff->pages_dev[page], GFP_KERNEL);
-        if (!buff->pages_kern[page]) {
-            DEBUG("init_buffer: page_kern %lu", page);
+        /* Zeroed, since the user may read the buffer before writing it. Mapping it flushes the zeroes. */
+        buff->pages[page] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+        if (!buff->pages[page]) {
+            DEBUG("init_buffer: alloc_page %lu", page);
+            goto out_pages;
+        }
+        buff->pages_dev[page] = dma_map_page(dev, buff->pages[page], 0, HARDDOOM2_PAGE_SIZE, DMA_BIDIRECTIONAL);
+        if (dma_mapping_error(dev, buff->pages_dev[page])) {
+            DEBUG("init_buffer: dma_map_page %lu", page);
+            __free_page(buff->pages[page]);
             goto out_pages;
         }
         if (buff->pages_dev[page] & 0xfff) {
@@ -44,6 +79,12 @@ int init_dma_buff(struct dma_buffer* buff, size_t size, struct device* dev) {
         page_table[page] = ((buff->pages_dev[page] >> 12) << 4) | 3;
     }
 
+    /* Map the pages contiguously, so that copies don't have to be split at page boundaries. */
+    if (!(buff->vaddr = vmap(buff->pages, num_pages, VM_MAP, PAGE_KERNEL))) {
+        DEBUG("init_dma_buff: vmap");
+        goto out_pages;
+    }
+
     buff->size = size;
     buff->dev = dev;
 
@@ -52,7 +93,8 @@ int init_dma_buff(struct dma_buffer* buff, size_t size, struct device* dev) {
 out_pages:
     num_pages = page;
     for (page = 0; page < num_pages; ++page) {
-        dma_free_coherent(dev, HARDDOOM2_PAGE_SIZE, buff->pages_kern[page], buff->pages_dev[page]);
+        dma_unmap_page(dev, buff->pages_dev[page], HARDDOOM2_PAGE_SIZE, DMA_BIDIRECTIONAL);
+        __free_page(buff->pages[page]);
     }
 
 out_table:
@@ -65,158 +107,42 @@ void free_dma_buff(struct dma_buffer* buff) {
     struct device* dev = buff->dev;
     size_t num_pages = (buff->size + HARDDOOM2_PAGE_SIZE - 1) / HARDDOOM2_PAGE_SIZE;
 
+    vunmap(buff->vaddr);
+
     size_t page;
     for (page = 0; page < num_pages; ++page) {
-        dma_free_coherent(dev, HARDDOOM2_PAGE_SIZE, buff->pages_kern[page], buff->pages_dev[page]);
+        dma_unmap_page(dev, buff->pages_dev[page], HARDDOOM2_PAGE_SIZE, DMA_BIDIRECTIONAL);
+        __free_page(buff->pages[page]);
     }
 
     dma_free_coherent(dev, HARDDOOM2_PAGE_SIZE, buff->page_table_kern, buff->page_table_dev);
 }
 
-void write_dma_buff(struct dma_buffer* buff, const void* src, size_t dst_pos, size_t size) {
-    BUG_ON(dst_pos + size < dst_pos || dst_pos + size > buff->size);
-
-    size_t page = dst_pos / HARDDOOM2_PAGE_SIZE;
-    size_t page_off = dst_pos % HARDDOOM2_PAGE_SIZE;
-
-    void* dst = buff->pages_kern[page] + page_off;
-
-    size_t space_in_page = HARDDOOM2_PAGE_SIZE - page_off;
-    if (space_in_page > size) {
-        space_in_page = size;
-    }
-
-    memcpy(dst, src, space_in_page);
-    src += space_in_page;
-    size -= space_in_page;
-
-    while (size >= HARDDOOM2_PAGE_SIZE) {
-        BUG_ON(page >= DIV_ROUND_UP(buff->size, HARDDOOM2_PAGE_SIZE));
-
-        dst = buff->pages_kern[++page];
-        memcpy(dst, src, HARDDOOM2_PAGE_SIZE);
-        src += HARDDOOM2_PAGE_SIZE;
-        size -= HARDDOOM2_PAGE_SIZE;
-    }
-
-    if (size) {
-        BUG_ON(page >= DIV_ROUND_UP(buff->size, HARDDOOM2_PAGE_SIZE));
-        dst = buff->pages_kern[++page];
-        memcpy(dst, src, size);
-    }
-}
-
 ssize_t write_dma_buff_user(struct dma_buffer* buff, const void __user* src, size_t dst_pos, size_t size) {
     BUG_ON(dst_pos + size < dst_pos || dst_pos + size > buff->size);
 
-    size_t page = dst_pos / HARDDOOM2_PAGE_SIZE;
-    size_t page_off = dst_pos % HARDDOOM2_PAGE_SIZE;
-
-    void* dst = buff->pages_kern[page] + page_off;
-
-    size_t space_in_page = HARDDOOM2_PAGE_SIZE - page_off;
-    if (space_in_page > size) {
-        space_in_page = size;
-    }
-
-    unsigned long left = copy_from_user(dst, src, space_in_page);
-    ssize_t copied = space_in_page - left;
-    if (left) {
+    /* The device may have written the pages, don't let stale cache lines get written back over that. */
+    sync_range(buff, dst_pos, size, false);
+    unsigned long left = copy_from_user(buff->vaddr + dst_pos, src, size);
+    sync_range(buff, dst_pos, size, true);
+    if (left == size && size) {
         DEBUG("write_dma_buff_user: copy_from_user fail");
-        goto out_copy;
-    }
-
-    src += space_in_page;
-    size -= space_in_page;
-
-    while (size >= HARDDOOM2_PAGE_SIZE) {
-        BUG_ON(page >= DIV_ROUND_UP(buff->size, HARDDOOM2_PAGE_SIZE));
-
-        dst = buff->pages_kern[++page];
-        left = copy_from_user(dst, src, HARDDOOM2_PAGE_SIZE);
-        copied += HARDDOOM2_PAGE_SIZE - left;
-        if (left) {
-            DEBUG("write_dma_buff_user: copy_from_user fail");
-            goto out_copy;
-        }
-
-        src += HARDDOOM2_PAGE_SIZE;
-        size -= HARDDOOM2_PAGE_SIZE;
+        return -EFAULT;
     }
 
-    if (size) {
-        BUG_ON(page >= DIV_ROUND_UP(buff->size, HARDDOOM2_PAGE_SIZE));
-        dst = buff->pages_kern[++page];
-        left = copy_from_user(dst, src, size);
-        copied += size - left;
-        if (left) {
-            DEBUG("write_dma_buff_user: copy_from_user fail");
-            goto out_copy;
-        }
-    }
-
-    return copied;
-
-out_copy:
-    if (copied)
-        return copied;
-    return -EFAULT;
+    return size - left;
 }
 
 ssize_t read_dma_buff_user(const struct dma_buffer* buff, void __user* dst, size_t src_pos, size_t size) {
     BUG_ON(src_pos + size < src_pos || src_pos + size > buff->size);
 
-    size_t page = src_pos / HARDDOOM2_PAGE_SIZE;
-    size_t page_off = src_pos % HARDDOOM2_PAGE_SIZE;
-
-    void* src = buff->pages_kern[page] + page_off;
-
-    size_t space_in_page = HARDDOOM2_PAGE_SIZE - page_off;
-    if (space_in_page > size) {
-        space_in_page = size;
-    }
-
-    unsigned long left = copy_to_user(dst, src, space_in_page);
-    ssize_t copied = space_in_page - left;
-    if (left) {
+    sync_range(buff, src_pos, size, false);
+    unsigned long left = copy_to_user(dst, buff->vaddr + src_pos, size);
+    sync_range(buff, src_pos, size, true);
+    if (left == size && size) {
         DEBUG("read_dma_buff_user: copy to user fail");
-        goto out_copy;
-    }
-
-    dst += space_in_page;
-    size -= space_in_page;
-
-    while (size >= HARDDOOM2_PAGE_SIZE) {
-        BUG_ON(page >= DIV_ROUND_UP(buff->size, HARDDOOM2_PAGE_SIZE));
-
-        src = buff->pages_kern[++page];
-        left = copy_to_user(dst, src, HARDDOOM2_PAGE_SIZE);
-        copied += HARDDOOM2_PAGE_SIZE - left;
-        if (left) {
-            DEBUG("read_dma_buff_user: copy to user fail");
-            goto out_copy;
-        }
-
-        dst += HARDDOOM2_PAGE_SIZE;
-        size -= HARDDOOM2_PAGE_SIZE;
+        return -EFAULT;
     }
 
-    if (size) {
-        BUG_ON(page >= DIV_ROUND_UP(buff->size, HARDDOOM2_PAGE_SIZE));
-
-        src = buff->pages_kern[++page];
-        left = copy_to_user(dst, src, size);
-        copied += size - left;
-        if (left) {
-            DEBUG("read_dma_buff_user: copy to user fail");
-            goto out_copy;
-        }
-    }
-
-    return copied;
-
-out_copy:
-    if (copied)
-        return copied;
-    return -EFAULT;
+    return size - left;
 }
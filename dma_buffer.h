@@ -5,13 +5,18 @@
 
 #define MAX_BUFFER_PAGES 1024
 
+/* Pages mapped for streaming DMA: the CPU accesses them through 'vaddr' (cached), so each access has to be
+   synced with the device. */
 struct dma_buffer {
-    void* pages_kern[MAX_BUFFER_PAGES];
+    struct page* pages[MAX_BUFFER_PAGES];
     dma_addr_t pages_dev[MAX_BUFFER_PAGES];
 
     void* page_table_kern;
     dma_addr_t page_table_dev;
 
+    /* All the pages mapped contiguously in the kernel address space. */
+    void* vaddr;
+
     size_t size;
 
     struct device* dev;
@@ -20,7 +25,8 @@ struct dma_buffer {
 int init_dma_buff(struct dma_buffer* buff, size_t size, struct device* dev);
 void free_dma_buff(struct dma_buffer* buff);
 
-void write_dma_buff(struct dma_buffer* buff, const void* src, size_t dst_pos, size_t size);
+/* Make the CPU's writes to [pos, pos + size) visible to the device. */
+void sync_dma_buff_for_device(const struct dma_buffer* buff, size_t pos, size_t size);
 
 ssize_t write_dma_buff_user(struct dma_buffer* buff, const void __user* src, size_t dst_pos, size_t size);
 ssize_t read_dma_buff_user(const struct dma_buffer* buff, void __user* dst, size_t src_pos, size_t size);
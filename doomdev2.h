@@ -30,9 +30,122 @@ struct doomdev2_ioctl_setup {
 	int32_t tranmap_fd;
 };
 
+/* Makes the buffer usable through a small per-context handle (returned by the ioctl),
+   which stays valid after the buffer's fd is closed. */
+struct doomdev2_ioctl_import_buffer {
+	int32_t fd;
+};
+
+/* A batch of commands sent with DOOMDEV2_IOCTL_SUBMIT, together with the buffers it uses
+   (as with DOOMDEV2_IOCTL_SETUP, or DOOMDEV2_IOCTL_SETUP_HANDLES if the HANDLES flag is set).
+   With the RELAXED flag, the driver may reorder nearby DRAW_COLUMN and DRAW_FUZZ commands so that
+   the device can draw more of them together.  Commands touching the same pixels, and any other
+   commands, keep their order, so the result is the same.
+   With the CULL flag, the driver drops commands whose whole destination rectangle a nearby later
+   opaque command (no TRANMAP, no fuzz, not a COPY_RECT within one surface) overwrites, unless
+   something in between reads the destination surface.  The culled pixels are counted in the
+   device's culled_pixels sysfs attribute. */
+#define DOOMDEV2_SUBMIT_BATCH_HANDLES	0x01
+#define DOOMDEV2_SUBMIT_BATCH_RELAXED	0x02
+#define DOOMDEV2_SUBMIT_BATCH_CULL	0x04
+#define DOOMDEV2_SUBMIT_BATCH_FLAGS	0x07
+
+struct doomdev2_submit_batch {
+	struct doomdev2_ioctl_setup bufs;
+	uint32_t flags;
+	uint64_t cmds_ptr;
+	uint32_t num_cmds;
+	uint32_t _pad;
+};
+
+/* Returns the number of batches sent in full.  If the next one failed (it had an invalid command,
+   or a signal or O_NONBLOCK interrupted it), 'partial_cmds' is set to the number of its commands
+   that were sent anyway, so that a retry starts after them.  The ioctl fails only if no command
+   was sent.  'fence' is set to the fence of the last batch sent (see DOOMDEV2_IOCTL_GET_FENCE). */
+struct doomdev2_ioctl_submit {
+	uint64_t batches_ptr;
+	uint32_t num_batches;
+	uint32_t partial_cmds;
+	uint64_t fence;
+};
+
+/* Signal 'eventfd' once the device finishes all commands sent up to 'fence'. */
+struct doomdev2_ioctl_fence_eventfd {
+	uint64_t fence;
+	int32_t eventfd;
+	uint32_t _pad;
+};
+
+/* How the context competes with others for the device.  Contexts with a higher priority
+   always go first; contexts with the same priority share the device in proportion
+   to their weights (in commands sent). */
+#define DOOMDEV2_PRIORITY_BATCH		0
+#define DOOMDEV2_PRIORITY_NORMAL	1
+#define DOOMDEV2_PRIORITY_INTERACTIVE	2
+
+#define DOOMDEV2_WEIGHT_DEFAULT		100
+#define DOOMDEV2_WEIGHT_MAX		10000
+
+struct doomdev2_ioctl_set_sched {
+	uint32_t priority;
+	uint32_t weight;
+};
+
+/* Validates and encodes the commands once against the context's current buffers.  Returns a handle
+   to the list, which DOOMDEV2_IOCTL_EXECUTE_LIST sends again whenever the current buffers are set
+   in the same slots and have the same sizes as when it was recorded. */
+struct doomdev2_ioctl_record_list {
+	uint64_t cmds_ptr;
+	uint32_t num_cmds;
+	uint32_t _pad;
+};
+
+/* Makes small write()s wait to be sent together: they're validated right away, but go to the device
+   once enough of them pile up, 'delay_us' after the first one, or when anyone waits for the device
+   to finish with a buffer or asks for the context's fence.  0 (the default) sends every write() at once. */
+#define DOOMDEV2_COALESCE_MAX_DELAY_US	100000
+
+struct doomdev2_ioctl_set_coalesce {
+	uint32_t delay_us;
+};
+
+/* Padding fields (named _pad) in the structures passed to these ioctls have to be zero, or the ioctl
+   fails with EINVAL, so that they can be given a meaning later. */
 #define DOOMDEV2_IOCTL_CREATE_SURFACE _IOW('D', 0x00, struct doomdev2_ioctl_create_surface)
 #define DOOMDEV2_IOCTL_CREATE_BUFFER _IOW('D', 0x01, struct doomdev2_ioctl_create_buffer)
 #define DOOMDEV2_IOCTL_SETUP _IOW('D', 0x02, struct doomdev2_ioctl_setup)
+#define DOOMDEV2_IOCTL_RING_DOORBELL _IO('D', 0x03)
+#define DOOMDEV2_IOCTL_SUBMIT _IOWR('D', 0x04, struct doomdev2_ioctl_submit)
+#define DOOMDEV2_IOCTL_IMPORT_BUFFER _IOW('D', 0x05, struct doomdev2_ioctl_import_buffer)
+#define DOOMDEV2_IOCTL_CLOSE_HANDLE _IO('D', 0x06)
+/* Like DOOMDEV2_IOCTL_SETUP, but the fields hold handles instead of fds. */
+#define DOOMDEV2_IOCTL_SETUP_HANDLES _IOW('D', 0x07, struct doomdev2_ioctl_setup)
+/* Returns the fence of the last batch sent by this context.  The context fd polls
+   readable once the device has passed it. */
+#define DOOMDEV2_IOCTL_GET_FENCE _IOR('D', 0x08, uint64_t)
+#define DOOMDEV2_IOCTL_FENCE_EVENTFD _IOW('D', 0x09, struct doomdev2_ioctl_fence_eventfd)
+#define DOOMDEV2_IOCTL_SET_SCHED _IOW('D', 0x0a, struct doomdev2_ioctl_set_sched)
+#define DOOMDEV2_IOCTL_RECORD_LIST _IOW('D', 0x0b, struct doomdev2_ioctl_record_list)
+/* Take the list handle as the argument.  EXECUTE_LIST returns the number of commands sent. */
+#define DOOMDEV2_IOCTL_EXECUTE_LIST _IO('D', 0x0c)
+#define DOOMDEV2_IOCTL_DESTROY_LIST _IO('D', 0x0d)
+/* Returns the number of columns drawn, which is less than num_cmds if one was invalid. */
+#define DOOMDEV2_IOCTL_DRAW_COLUMNS _IOW('D', 0x0e, struct doomdev2_ioctl_draw_columns)
+#define DOOMDEV2_IOCTL_SET_COALESCE _IOW('D', 0x0f, struct doomdev2_ioctl_set_coalesce)
+
+/* Buffer fd ioctls.  Their _pad fields have to be zero as well.  */
+
+/* How long reads and writes of the buffer busy-poll the device before sleeping
+   while waiting for the device to finish with the buffer.  DOOMDEV2_SPIN_ADAPTIVE (the default)
+   picks the budget based on recently observed batch durations, 0 disables spinning. */
+struct doomdev2_buffer_ioctl_set_spin {
+	uint32_t spin_ns;
+	uint32_t _pad;
+};
+
+#define DOOMDEV2_SPIN_ADAPTIVE 0xffffffff
+
+#define DOOMDEV2_BUFFER_IOCTL_SET_SPIN _IOW('D', 0x40, struct doomdev2_buffer_ioctl_set_spin)
 
 enum doomdev2_cmd_type {
 	DOOMDEV2_CMD_TYPE_COPY_RECT = 0,
@@ -159,4 +272,41 @@ _Static_assert(sizeof (struct doomdev2_cmd_draw_span) == 32, "cmd size mismatch"
 _Static_assert(sizeof (struct doomdev2_cmd_draw_fuzz) == 32, "cmd size mismatch");
 _Static_assert(sizeof (struct doomdev2_cmd) == 32, "cmd size mismatch");
 
+/* A run of DRAW_COLUMN commands in a compact form.  The stream at 'data_ptr' (of 'data_size' bytes)
+   holds 'num_cmds' columns, each relative to the previous one (the first one to 'base').
+   A column is a byte of DOOMDEV2_COLUMN_* bits saying which fields change, followed by their
+   differences (wrapping around), in the order of the bits, as zigzag LEB128 varints of at most 32 bits
+   (a stream with a longer one is rejected).  NEXT_X increments pos_x without a varint. */
+#define DOOMDEV2_COLUMN_NEXT_X		0x01
+#define DOOMDEV2_COLUMN_POS_X		0x02
+#define DOOMDEV2_COLUMN_POS_A_Y		0x04
+#define DOOMDEV2_COLUMN_POS_B_Y		0x08
+#define DOOMDEV2_COLUMN_TEXTURE_OFFSET	0x10
+#define DOOMDEV2_COLUMN_USTART		0x20
+#define DOOMDEV2_COLUMN_USTEP		0x40
+#define DOOMDEV2_COLUMN_ALL		0x7f
+
+#define DOOMDEV2_MAX_COLUMNS_SIZE	0x100000
+
+struct doomdev2_ioctl_draw_columns {
+	struct doomdev2_cmd_draw_column base;
+	uint64_t data_ptr;
+	uint32_t data_size;
+	uint32_t num_cmds;
+};
+
+/* Submission ring, shared with the driver by mmap()ing the /dev/doom* fd at offset 0
+   with a length of sizeof(struct doomdev2_ring).  The user writes commands at 'tail'
+   and advances it, then rings the doorbell (DOOMDEV2_IOCTL_RING_DOORBELL).  The driver
+   consumes commands starting at 'head' and advances it.  Both indices are taken modulo
+   DOOMDEV2_RING_CMDS; the ring is empty when head == tail. */
+#define DOOMDEV2_RING_CMDS 4096
+
+struct doomdev2_ring {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t _pad[6];
+	struct doomdev2_cmd cmds[DOOMDEV2_RING_CMDS];
+};
+
 #endif
@@ -3,15 +3,24 @@
 #include <linux/uaccess.h>
 #include <linux/bitmap.h>
 #include <linux/cdev.h>
+#include <linux/completion.h>
+#include <linux/delay.h>
+#include <linux/eventfd.h>
 #include <linux/pci.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/workqueue.h>
 
 #include "doomcode2.h"
 #include "harddoom2.h"
 
 #include "common.h"
 #include "context.h"
+#include "cull.h"
 #include "dma_buffer.h"
 #include "hd2.h"
+#include "region.h"
+#include "reorder.h"
 
 MODULE_LICENSE("GPL");
 
@@ -32,18 +41,69 @@ MODULE_LICENSE("GPL");
 
 #define PING_PERIOD 2048
 
+/* Number of recent batches whose submission times we remember. */
+#define BATCH_TIMES 64
+
+/* Adaptive waits don't spin if batches usually take longer than this. */
+#define ADAPTIVE_SPIN_MAX_NS 100000
+/* Upper limit on the spin budget set by the user. */
+#define SPIN_MAX_NS 1000000
+/* How long to wait between FENCE_COUNTER reads when spinning. */
+#define SPIN_POLL_NS 1000
+
+/* At most this many commands are queued in the command buffer at once, which bounds how long
+   a newly admitted batch waits behind the ones already queued. */
+#define SCHED_DEPTH 16384
+
+/* Virtual time a context with weight 1 spends on a command. */
+#define SCHED_VTIME_UNIT DOOMDEV2_WEIGHT_MAX
+
+/* Default for how long the first waiting writer may be passed over by writers using
+   the buffers already installed on the device, saving a SETUP each time. */
+#define COALESCE_WINDOW_NS 200000
+/* Upper limit on the window set through sysfs. */
+#define COALESCE_WINDOW_MAX_NS 10000000
+
+/* Limits on the estimated device time (in pixels, see cmds_within_cost) of a single batch,
+   of the batches a context has in flight and of all the batches in flight.
+   A batch always fits, so that no single submission can queue more than a few full-screen fills. */
+#define BATCH_COST_MAX (1ull << 22)
+#define CONTEXT_COST_MAX (1ull << 24)
+#define DEVICE_COST_MAX (1ull << 25)
+
+_Static_assert(BATCH_COST_MAX <= CONTEXT_COST_MAX && BATCH_COST_MAX <= DEVICE_COST_MAX, "cost limits");
+
+/* Batches of at most this many commands are pushed through CMD_SEND when the device
+   has finished everything sent before, which saves the fetch latency. The path is off until
+   a limit up to this one is set through sysfs: its gain hasn't been measured on a device
+   yet (see bench/latency_bench). */
+#define SEND_MAX_CMDS 8
+/* The FIFO is empty when the fast path is used; the batch and a SETUP have to fit. */
+_Static_assert(SEND_MAX_CMDS < HARDDOOM2_FIFO_FECMD_SIZE, "send max cmds");
+
+/* Lists at least this long are encoded by several CPUs, in parts of at least ENCODE_PART_CMDS commands. */
+#define PARALLEL_ENCODE_MIN_CMDS 8192
+#define ENCODE_PART_CMDS 2048
+
+/* Maximum number of batches being encoded at the same time. */
+#define MAX_RESERVED 64
+
+/* Number of commands harddoom2_write copies from the source at once, and reorders or culls at once. */
+#define FETCH_CMDS 32
+_Static_assert(FETCH_CMDS <= REORDER_WINDOW && FETCH_CMDS <= CULL_WINDOW, "reorder and cull windows");
+
+/* How often (in batches) the submission path reads FENCE_COUNTER if nothing else does. */
+#define FENCE_REFRESH_PERIOD 65536
+
 _Static_assert(PING_PERIOD <= CMD_BUF_LEN / 2, "ping period");
+/* Writers waiting for space rely on pings from the queued commands. */
+_Static_assert(PING_PERIOD <= SCHED_DEPTH / 2 && SCHED_DEPTH < CMD_BUF_LEN, "sched depth");
 
 static const struct pci_device_id pci_ids[] = {
     { PCI_DEVICE(HARDDOOM2_VENDOR_ID, HARDDOOM2_DEVICE_ID), },
     { /* end: all zeroes */ },
 };
 
-static struct class doom_class = {
-    .name = DRV_NAME,
-    .owner = THIS_MODULE,
-};
-
 /* Represents a single device. */
 struct harddoom2 {
     /* The number of this device, between 0 and 255. */
@@ -53,7 +113,8 @@ struct harddoom2 {
     struct pci_dev* pdev;
     struct cdev cdev;
 
-    /* The command buffer. */
+    /* The command buffer. cmd_buff_lock is never held while commands are copied from their source,
+       which may fault on user memory and would hold up every writer. */
     struct mutex cmd_buff_lock;
     struct dma_buffer cmd_buff;
 
@@ -65,21 +126,77 @@ struct harddoom2 {
     spinlock_t fence_cnt_lock;
     counter last_fence_cnt;
 
-    /* Last set value of the FENCE_WAIT register expanded to 64 bits. */
-    spinlock_t fence_wait_lock;
+    /* Submission times of the last BATCH_TIMES batches, indexed by fence modulo BATCH_TIMES. */
+    uint64_t batch_submit_ns[BATCH_TIMES];
+    /* Moving average of the time a batch takes on the device, sampled in the FENCE and PONG_ASYNC
+       interrupts together with the fence counter and the time of the last sample.
+       Protected by fence_cnt_lock. */
+    uint64_t avg_batch_ns;
+    counter sampled_cnt;
+    uint64_t sampled_ns;
+
+    /* Pending fence waiters, sorted by fence. FENCE_WAIT is kept pointing at the first one,
+       so that the interrupt handler only wakes up the waiters whose fences have passed. */
+    spinlock_t timeline_lock;
+    struct list_head timeline;
+
+    /* Last set value of the FENCE_WAIT register expanded to 64 bits. Protected by timeline_lock. */
     counter last_fence_wait;
 
     /* Used to protect access to the active interrupts register, which might be read concurrently. */
     spinlock_t intr_flags_lock;
 
-    /* Used to protect access to the WRITE_IDX register. */
-    spinlock_t write_idx_lock;
-
-    /* Used to wait for free space in the command buffer. */
+    /* Software copies of registers, so that we don't have to read them back from the device.
+       read_idx is only refreshed from the device when it looks like there isn't enough space.
+       Protected by cmd_buff_lock. */
+    uint32_t read_idx;
+    uint32_t intr_enable;
+
+    /* Writers reserve slots in the command buffer under cmd_buff_lock, encode their batches
+       concurrently and publish them in the order of reservation.
+       reserve_idx is the end of the reserved slots, protected by cmd_buff_lock. */
+    uint32_t reserve_idx;
+
+    /* The rest is protected by publish_lock. write_idx is the end of the published slots (the WRITE_IDX register),
+       published_cnt the last published batch. For each batch that's reserved but not published yet,
+       indexed by fence modulo MAX_RESERVED, we know the end of its slots and whether it's encoded. */
+    spinlock_t publish_lock;
+    uint32_t write_idx;
+    counter published_cnt;
+    uint32_t reserved_end[MAX_RESERVED];
+    bool encoded[MAX_RESERVED];
+    /* Estimated costs of the encoded batches, and of the published ones which haven't finished. */
+    uint64_t batch_cost[MAX_RESERVED];
+    struct cost_tracker cost;
+
+    /* Used to wait until there are less than MAX_RESERVED unpublished batches. */
+    wait_queue_head_t publish_wq;
+
+    /* Number of register accesses, for the statistics in sysfs. */
+    atomic64_t mmio_cnt;
+    /* Pixels of the commands dropped by cull_cmds, for the statistics in sysfs. Batches are encoded concurrently. */
+    atomic64_t culled_pixels;
+
+    /* Used to wait for free space in the command buffer and for the turn to use it. */
     wait_queue_head_t write_wq;
 
-    /* Used to wait for commands using a particular buffer to finish. */
-    wait_queue_head_t fence_wq;
+    /* Writers waiting to reserve space, sorted by priority and then by virtual time.
+       sched_head is the only one allowed to reserve (see sched_pick), also read without the lock.
+       sched_vtime is the virtual time of the last admitted writer. Protected by cmd_buff_lock. */
+    struct list_head sched_queue;
+    struct sched_entity* sched_head;
+    uint64_t sched_vtime;
+
+    /* Within this window, writers whose buffers are already installed go before the first one. */
+    uint32_t coalesce_ns;
+
+    /* Batches of at most this many commands may be sent through CMD_SEND (0, the default, turns it off). */
+    uint32_t direct_max_cmds;
+
+    /* Number of SETUP commands that loaded buffers and of batches sent through CMD_SEND,
+       for the statistics in sysfs. Protected by cmd_buff_lock. */
+    counter setup_cnt;
+    counter direct_cnt;
 
     /* Manages the lifetime of buffers used by the device.
        When a SETUP command is sent to the command queue, we remember the set of changed buffers
@@ -89,6 +206,12 @@ struct harddoom2 {
 
     /* Buffers used in the last SETUP command sent to the command buffer. */
     struct hd2_buffer* curr_bufs[NUM_USER_BUFS];
+
+    /* Registered pending_flushers. Flushing only starts their work, so the lock is a spinlock
+       (taken by poll). flush_wq is woken up whenever one of them has sent everything. */
+    spinlock_t flushers_lock;
+    struct list_head flushers;
+    wait_queue_head_t flush_wq;
 };
 
 struct buffer_change {
@@ -109,20 +232,146 @@ struct harddoom2* get_hd2(unsigned num) {
     return &devices[num];
 }
 
+/* Statistics in the sysfs directory of the device. */
+
+static ssize_t mmio_accesses_show(struct device* dev, struct device_attribute* attr, char* buf) {
+    struct harddoom2* hd2 = dev_get_drvdata(dev);
+    return scnprintf(buf, PAGE_SIZE, "%llu\n", (unsigned long long)atomic64_read(&hd2->mmio_cnt));
+}
+static DEVICE_ATTR_RO(mmio_accesses);
+
+static ssize_t batches_show(struct device* dev, struct device_attribute* attr, char* buf) {
+    struct harddoom2* hd2 = dev_get_drvdata(dev);
+    return scnprintf(buf, PAGE_SIZE, "%llu\n", (unsigned long long)READ_ONCE(hd2->batch_cnt));
+}
+static DEVICE_ATTR_RO(batches);
+
+/* Prints the average of 'total' per batch, with two decimal places. */
+static ssize_t show_per_batch(struct harddoom2* hd2, uint64_t total, char* buf) {
+    uint64_t batches = READ_ONCE(hd2->batch_cnt);
+    uint64_t per_batch = batches ? div64_u64(100 * total, batches) : 0;
+    uint32_t frac = do_div(per_batch, 100);
+    return scnprintf(buf, PAGE_SIZE, "%llu.%02u\n", (unsigned long long)per_batch, frac);
+}
+
+static ssize_t mmio_per_batch_show(struct device* dev, struct device_attribute* attr, char* buf) {
+    struct harddoom2* hd2 = dev_get_drvdata(dev);
+    return show_per_batch(hd2, atomic64_read(&hd2->mmio_cnt), buf);
+}
+static DEVICE_ATTR_RO(mmio_per_batch);
+
+static ssize_t setups_show(struct device* dev, struct device_attribute* attr, char* buf) {
+    struct harddoom2* hd2 = dev_get_drvdata(dev);
+    return scnprintf(buf, PAGE_SIZE, "%llu\n", (unsigned long long)READ_ONCE(hd2->setup_cnt));
+}
+static DEVICE_ATTR_RO(setups);
+
+static ssize_t setups_per_batch_show(struct device* dev, struct device_attribute* attr, char* buf) {
+    struct harddoom2* hd2 = dev_get_drvdata(dev);
+    return show_per_batch(hd2, READ_ONCE(hd2->setup_cnt), buf);
+}
+static DEVICE_ATTR_RO(setups_per_batch);
+
+static ssize_t direct_batches_show(struct device* dev, struct device_attribute* attr, char* buf) {
+    struct harddoom2* hd2 = dev_get_drvdata(dev);
+    return scnprintf(buf, PAGE_SIZE, "%llu\n", (unsigned long long)READ_ONCE(hd2->direct_cnt));
+}
+static DEVICE_ATTR_RO(direct_batches);
+
+static ssize_t culled_pixels_show(struct device* dev, struct device_attribute* attr, char* buf) {
+    struct harddoom2* hd2 = dev_get_drvdata(dev);
+    return scnprintf(buf, PAGE_SIZE, "%llu\n", (unsigned long long)atomic64_read(&hd2->culled_pixels));
+}
+static DEVICE_ATTR_RO(culled_pixels);
+
+static ssize_t coalesce_window_us_show(struct device* dev, struct device_attribute* attr, char* buf) {
+    struct harddoom2* hd2 = dev_get_drvdata(dev);
+    return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(hd2->coalesce_ns) / (uint32_t)NSEC_PER_USEC);
+}
+
+static ssize_t coalesce_window_us_store(struct device* dev, struct device_attribute* attr,
+        const char* buf, size_t count) {
+    struct harddoom2* hd2 = dev_get_drvdata(dev);
+    unsigned window_us;
+
+    int err = kstrtouint(buf, 10, &window_us);
+    if (err) {
+        return err;
+    }
+    if (window_us > COALESCE_WINDOW_MAX_NS / NSEC_PER_USEC) {
+        return -EINVAL;
+    }
+
+    WRITE_ONCE(hd2->coalesce_ns, window_us * NSEC_PER_USEC);
+    return count;
+}
+static DEVICE_ATTR_RW(coalesce_window_us);
+
+static ssize_t direct_max_cmds_show(struct device* dev, struct device_attribute* attr, char* buf) {
+    struct harddoom2* hd2 = dev_get_drvdata(dev);
+    return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(hd2->direct_max_cmds));
+}
+
+static ssize_t direct_max_cmds_store(struct device* dev, struct device_attribute* attr,
+        const char* buf, size_t count) {
+    struct harddoom2* hd2 = dev_get_drvdata(dev);
+    unsigned max_cmds;
+
+    int err = kstrtouint(buf, 10, &max_cmds);
+    if (err) {
+        return err;
+    }
+    if (max_cmds > SEND_MAX_CMDS) {
+        return -EINVAL;
+    }
+
+    WRITE_ONCE(hd2->direct_max_cmds, max_cmds);
+    return count;
+}
+static DEVICE_ATTR_RW(direct_max_cmds);
+
+static struct attribute* doom_attrs[] = {
+    &dev_attr_mmio_accesses.attr,
+    &dev_attr_batches.attr,
+    &dev_attr_mmio_per_batch.attr,
+    &dev_attr_setups.attr,
+    &dev_attr_setups_per_batch.attr,
+    &dev_attr_direct_batches.attr,
+    &dev_attr_culled_pixels.attr,
+    &dev_attr_coalesce_window_us.attr,
+    &dev_attr_direct_max_cmds.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(doom);
+
+static struct class doom_class = {
+    .name = DRV_NAME,
+    .owner = THIS_MODULE,
+    .dev_groups = doom_groups,
+};
+
+/* Register accesses after the device is set up go through these, so that we can count them.
+   Every access is expensive (under an emulator each one is a VM exit). */
+static uint32_t hd2_ioread(struct harddoom2* hd2, unsigned reg) {
+    atomic64_inc(&hd2->mmio_cnt);
+    return ioread32(hd2->bar + reg);
+}
+
+static void hd2_iowrite(struct harddoom2* hd2, uint32_t val, unsigned reg) {
+    atomic64_inc(&hd2->mmio_cnt);
+    iowrite32(val, hd2->bar + reg);
+}
+
 struct cmd {
     uint32_t data[HARDDOOM2_CMD_SEND_SIZE];
 };
 
 _Static_assert(sizeof(struct cmd) == 32, "struct cmd size");
 
-static struct cmd make_cmd(const struct harddoom2* hd2, const struct doomdev2_cmd* user_cmd, uint32_t extra_flags) {
+static struct cmd make_cmd(const struct bind_limits* limits, const struct doomdev2_cmd* user_cmd,
+        uint32_t extra_flags) {
     switch (user_cmd->type) {
     case DOOMDEV2_CMD_TYPE_COPY_RECT: {
-        if (!interlocked(hd2->curr_bufs[SRC_BUF_IDX])) {
-            extra_flags |= HARDDOOM2_CMD_FLAG_INTERLOCK;
-            interlock(hd2->curr_bufs[SRC_BUF_IDX]);
-        }
-
         const struct doomdev2_cmd_copy_rect* cmd = &user_cmd->copy_rect;
         return (struct cmd){ .data = {
             HARDDOOM2_CMD_W0(HARDDOOM2_CMD_TYPE_COPY_RECT, extra_flags),
@@ -189,7 +438,7 @@ static struct cmd make_cmd(const struct harddoom2* hd2, const struct doomdev2_cm
             cmd->ustart,
             cmd->ustep,
             HARDDOOM2_CMD_W6_B(cmd->texture_offset),
-            HARDDOOM2_CMD_W7_B((get_buff_size(hd2->curr_bufs[TEXTURE_BUF_IDX]) - 1) >> 6, cmd->texture_height)
+            HARDDOOM2_CMD_W7_B(limits->texture_limit, cmd->texture_height)
         }};
     }
     case DOOMDEV2_CMD_TYPE_DRAW_SPAN: {
@@ -228,7 +477,11 @@ static struct cmd make_cmd(const struct harddoom2* hd2, const struct doomdev2_cm
     BUG();
 }
 
-static struct cmd make_setup(struct hd2_buffer* bufs[NUM_USER_BUFS], uint32_t extra_flags) {
+#define ALL_BUFS_MASK ((1u << NUM_USER_BUFS) - 1)
+
+/* Make a SETUP command loading the buffers in 'bufs' whose bits are set in 'mask'.
+   Units with unset bits keep their page tables (and TLB entries). */
+static struct cmd make_setup(struct hd2_buffer* bufs[NUM_USER_BUFS], unsigned mask, uint32_t extra_flags) {
     static const uint32_t bufs_flags[NUM_USER_BUFS] = {
         HARDDOOM2_CMD_FLAG_SETUP_SURF_DST, HARDDOOM2_CMD_FLAG_SETUP_SURF_SRC,
         HARDDOOM2_CMD_FLAG_SETUP_TEXTURE, HARDDOOM2_CMD_FLAG_SETUP_FLAT,
@@ -236,7 +489,7 @@ static struct cmd make_setup(struct hd2_buffer* bufs[NUM_USER_BUFS], uint32_t ex
 
     int i;
     for (i = 0; i < NUM_USER_BUFS; ++i) {
-        if (bufs[i]) {
+        if (bufs[i] && (mask & (1u << i))) {
             extra_flags |= bufs_flags[i];
         }
     }
@@ -254,34 +507,44 @@ static struct cmd make_setup(struct hd2_buffer* bufs[NUM_USER_BUFS], uint32_t ex
     return cmd;
 }
 
-static void write_cmd(struct harddoom2* hd2, struct cmd* cmd, size_t write_idx) {
-    struct dma_buffer* buff = &hd2->cmd_buff;
+/* The command buffer is mapped contiguously, so commands are written straight into their slots. */
+static struct cmd* cmd_slot(struct harddoom2* hd2, size_t write_idx) {
     BUG_ON(write_idx >= CMD_BUF_LEN);
-    BUG_ON(buff->size != CMD_BUF_LEN * CMD_SEND_BYTES);
+    return (struct cmd*)hd2->cmd_buff.vaddr + write_idx;
+}
 
-    size_t dst_pos = write_idx * CMD_SEND_BYTES;
-    return write_dma_buff(buff, cmd->data, dst_pos, CMD_SEND_BYTES);
+/* Make the slots [start, start + num) (wrapping around the end) visible to the device.
+   The device never writes the command buffer, so the CPU doesn't have to sync before writing it. */
+static void sync_cmd_slots(struct harddoom2* hd2, uint32_t start, size_t num) {
+    size_t first_part = min_t(size_t, num, CMD_BUF_LEN - start);
+    sync_dma_buff_for_device(&hd2->cmd_buff, start * sizeof(struct cmd), first_part * sizeof(struct cmd));
+    sync_dma_buff_for_device(&hd2->cmd_buff, 0, (num - first_part) * sizeof(struct cmd));
 }
 
+static void write_cmd(struct harddoom2* hd2, struct cmd* cmd, size_t write_idx) {
+    *cmd_slot(hd2, write_idx) = *cmd;
+    sync_cmd_slots(hd2, write_idx, 1);
+}
+
+/* Install 'bufs' as the device's current buffers.
+   Returns the mask of slots which have to be reloaded by a SETUP command, or negative error code. */
 static int update_buffers(struct harddoom2* hd2, struct hd2_buffer* bufs[NUM_USER_BUFS]) {
     int has_change = 0;
-    int is_diff = 0;
+    int mask = 0;
 
     int i;
     for (i = 0; i < NUM_USER_BUFS; ++i) {
         if (bufs[i] != hd2->curr_bufs[i]) {
-            is_diff = 1;
+            /* A slot that became empty doesn't need reloading: no command will use it. */
+            if (bufs[i]) {
+                mask |= 1 << i;
+            }
             if (hd2->curr_bufs[i]) {
                 has_change = 1;
-                break;
             }
         }
     }
 
-    if (!is_diff) {
-        return 0;
-    }
-
     struct buffer_change* change = NULL;
     if (has_change) {
         change = kzalloc(sizeof(struct buffer_change), GFP_KERNEL);
@@ -306,11 +569,11 @@ static int update_buffers(struct harddoom2* hd2, struct hd2_buffer* bufs[NUM_USE
         hd2->curr_bufs[i] = bufs[i];
     }
 
-    return 1;
+    return mask;
 }
 
 static void _update_last_fence_cnt(struct harddoom2* hd2) {
-    uint32_t curr_lower = ioread32(hd2->bar + HARDDOOM2_FENCE_COUNTER);
+    uint32_t curr_lower = hd2_ioread(hd2, HARDDOOM2_FENCE_COUNTER);
     uint32_t last_lower = cnt_lower(hd2->last_fence_cnt);
 
     uint32_t upper = cnt_upper(hd2->last_fence_cnt);
@@ -320,53 +583,286 @@ static void _update_last_fence_cnt(struct harddoom2* hd2) {
     hd2->last_fence_cnt = make_cnt(upper, curr_lower);
 }
 
-static void bump_fence_wait(struct harddoom2* hd2, counter cnt) {
-    spin_lock(&hd2->fence_wait_lock);
-    if (cnt < hd2->last_fence_wait) {
-        goto out;
-    }
+/* Called from the interrupts, which come as soon as the device gets to a fence or a ping: the batches
+   finished since the last sample ran since then, or since the first of them was submitted if the device
+   was idle in between. Waiters notice completion later than that, so they don't sample.
+   Returns the fence counter it read. */
+static counter sample_batch_time(struct harddoom2* hd2) {
+    unsigned long flags;
+    spin_lock_irqsave(&hd2->fence_cnt_lock, flags);
+    _update_last_fence_cnt(hd2);
 
-    iowrite32(cnt_lower(cnt), hd2->bar + HARDDOOM2_FENCE_WAIT);
-    hd2->last_fence_wait = cnt;
+    counter curr = hd2->last_fence_cnt;
+    counter first = hd2->sampled_cnt + 1;
+    uint64_t now = ktime_get_ns();
+    /* The slot of batch 'first' hasn't been reused yet. */
+    if (curr >= first && READ_ONCE(hd2->batch_cnt) - first < BATCH_TIMES) {
+        uint64_t start = max(hd2->sampled_ns, READ_ONCE(hd2->batch_submit_ns[first % BATCH_TIMES]));
+        uint64_t per_batch = now > start ? div64_u64(now - start, curr - hd2->sampled_cnt) : 0;
+        hd2->avg_batch_ns = (7 * hd2->avg_batch_ns + per_batch) / 8;
+    }
+    hd2->sampled_cnt = curr;
+    hd2->sampled_ns = now;
 
-out:
-    spin_unlock(&hd2->fence_wait_lock);
+    spin_unlock_irqrestore(&hd2->fence_cnt_lock, flags);
+    return curr;
 }
 
+/* Also called from the interrupt handler. */
 static counter get_curr_fence_cnt(struct harddoom2* hd2) {
     counter res;
-    spin_lock(&hd2->fence_cnt_lock);
+    unsigned long flags;
+    spin_lock_irqsave(&hd2->fence_cnt_lock, flags);
+    _update_last_fence_cnt(hd2);
+    res = hd2->last_fence_cnt;
+    spin_unlock_irqrestore(&hd2->fence_cnt_lock, flags);
+    return res;
+}
+
+static void update_last_fence_cnt(struct harddoom2* hd2) {
+    unsigned long flags;
+    spin_lock_irqsave(&hd2->fence_cnt_lock, flags);
     _update_last_fence_cnt(hd2);
+    spin_unlock_irqrestore(&hd2->fence_cnt_lock, flags);
+}
+
+/* Like get_curr_fence_cnt, but without asking the device. The result might be out of date. */
+static counter get_last_fence_cnt(struct harddoom2* hd2) {
+    counter res;
+    unsigned long flags;
+    spin_lock_irqsave(&hd2->fence_cnt_lock, flags);
     res = hd2->last_fence_cnt;
-    spin_unlock(&hd2->fence_cnt_lock);
+    spin_unlock_irqrestore(&hd2->fence_cnt_lock, flags);
     return res;
 }
 
-void wait_for_fence_cnt(struct harddoom2* hd2, counter cnt) {
+/* Signal the waiters whose fences have passed, given the fence counter 'cnt' just read from the device,
+   and point FENCE_WAIT at the next pending fence. Must be called with timeline_lock held. */
+static void _process_timeline(struct harddoom2* hd2, counter cnt) {
+    for (;;) {
+        while (!list_empty(&hd2->timeline)) {
+            struct fence_waiter* w = list_first_entry(&hd2->timeline, struct fence_waiter, list);
+            if (cnt < w->cnt) break;
+
+            list_del_init(&w->list);
+            w->signal(w);
+        }
+
+        if (list_empty(&hd2->timeline)) {
+            return;
+        }
+
+        counter next = list_first_entry(&hd2->timeline, struct fence_waiter, list)->cnt;
+        if (next == hd2->last_fence_wait) {
+            return;
+        }
+
+        hd2_iowrite(hd2, cnt_lower(next), HARDDOOM2_FENCE_WAIT);
+        hd2->last_fence_wait = next;
+        /* The device might have passed the fence before we set FENCE_WAIT, check again. */
+        cnt = get_curr_fence_cnt(hd2);
+    }
+}
+
+void init_fence_waiter(struct fence_waiter* w, void (*signal)(struct fence_waiter*)) {
+    w->cnt = 0;
+    w->signal = signal;
+    INIT_LIST_HEAD(&w->list);
+}
+
+void arm_fence_waiter(struct harddoom2* hd2, struct fence_waiter* w, counter cnt) {
+    unsigned long flags;
+    spin_lock_irqsave(&hd2->timeline_lock, flags);
+
+    list_del_init(&w->list);
+    w->cnt = cnt;
+
+    /* Most waiters wait for recent fences, so look for the place from the back. */
+    struct fence_waiter* pos;
+    list_for_each_entry_reverse(pos, &hd2->timeline, list) {
+        if (pos->cnt <= cnt) break;
+    }
+    list_add(&w->list, &pos->list);
+
+    _process_timeline(hd2, get_curr_fence_cnt(hd2));
+
+    spin_unlock_irqrestore(&hd2->timeline_lock, flags);
+}
+
+void cancel_fence_waiter(struct harddoom2* hd2, struct fence_waiter* w) {
+    unsigned long flags;
+    spin_lock_irqsave(&hd2->timeline_lock, flags);
+    list_del_init(&w->list);
+    spin_unlock_irqrestore(&hd2->timeline_lock, flags);
+}
+
+static void signal_all_waiters(struct harddoom2* hd2) {
+    unsigned long flags;
+    spin_lock_irqsave(&hd2->timeline_lock, flags);
+    while (!list_empty(&hd2->timeline)) {
+        struct fence_waiter* w = list_first_entry(&hd2->timeline, struct fence_waiter, list);
+        list_del_init(&w->list);
+        w->signal(w);
+    }
+    spin_unlock_irqrestore(&hd2->timeline_lock, flags);
+}
+
+bool fence_cnt_passed(struct harddoom2* hd2, counter cnt) {
+    return get_curr_fence_cnt(hd2) >= cnt;
+}
+
+struct task_waiter {
+    struct fence_waiter w;
+    struct completion done;
+};
+
+static void signal_task_waiter(struct fence_waiter* w) {
+    complete(&container_of(w, struct task_waiter, w)->done);
+}
+
+static uint64_t adaptive_spin_ns(struct harddoom2* hd2) {
+    uint64_t avg = READ_ONCE(hd2->avg_batch_ns);
+    if (avg > ADAPTIVE_SPIN_MAX_NS) {
+        /* Spinning wouldn't pay off, just sleep. */
+        return 0;
+    }
+    return 2 * avg;
+}
+
+/* Busy-poll FENCE_COUNTER for at most 'budget_ns'. Returns whether the fence has passed. */
+static bool spin_for_fence_cnt(struct harddoom2* hd2, counter cnt, uint64_t budget_ns) {
+    uint64_t deadline = ktime_get_ns() + budget_ns;
+    do {
+        ndelay(SPIN_POLL_NS);
+        if (get_curr_fence_cnt(hd2) >= cnt) {
+            return true;
+        }
+    } while (ktime_get_ns() < deadline);
+
+    return false;
+}
+
+void wait_for_fence_cnt(struct harddoom2* hd2, counter cnt, uint32_t spin_ns) {
     if (get_curr_fence_cnt(hd2) >= cnt) {
         return;
     }
 
-    bump_fence_wait(hd2, cnt);
-    if (get_curr_fence_cnt(hd2) >= cnt) {
+    uint64_t budget_ns = spin_ns == DOOMDEV2_SPIN_ADAPTIVE ?
+        adaptive_spin_ns(hd2) : min_t(uint64_t, spin_ns, SPIN_MAX_NS);
+    if (budget_ns && spin_for_fence_cnt(hd2, cnt, budget_ns)) {
         return;
     }
 
     DEBUG("wait for fence: %llu", cnt);
 
-    wait_event(hd2->fence_wq, get_curr_fence_cnt(hd2) >= cnt);
+    struct task_waiter waiter;
+    init_fence_waiter(&waiter.w, signal_task_waiter);
+    init_completion(&waiter.done);
+
+    arm_fence_waiter(hd2, &waiter.w, cnt);
+    wait_for_completion(&waiter.done);
 
     DEBUG("wait for fence: %llu finished", cnt);
 }
 
-static void update_last_fence_cnt(struct harddoom2* hd2) {
-    spin_lock(&hd2->fence_cnt_lock);
-    _update_last_fence_cnt(hd2);
-    spin_unlock(&hd2->fence_cnt_lock);
+void init_pending_flusher(struct pending_flusher* f, bool (*flush)(struct pending_flusher*)) {
+    f->flush = flush;
+    INIT_LIST_HEAD(&f->list);
+}
+
+void harddoom2_add_flusher(struct harddoom2* hd2, struct pending_flusher* f) {
+    spin_lock(&hd2->flushers_lock);
+    if (list_empty(&f->list)) {
+        list_add_tail(&f->list, &hd2->flushers);
+    }
+    spin_unlock(&hd2->flushers_lock);
+}
+
+void harddoom2_remove_flusher(struct harddoom2* hd2, struct pending_flusher* f) {
+    spin_lock(&hd2->flushers_lock);
+    list_del_init(&f->list);
+    spin_unlock(&hd2->flushers_lock);
+}
+
+bool harddoom2_flush_pending(struct harddoom2* hd2) {
+    /* Most of the time nobody holds anything back. */
+    if (list_empty(&hd2->flushers)) {
+        return false;
+    }
+
+    bool pending = false;
+    spin_lock(&hd2->flushers_lock);
+    struct pending_flusher* f;
+    list_for_each_entry(f, &hd2->flushers, list) {
+        pending |= f->flush(f);
+    }
+    spin_unlock(&hd2->flushers_lock);
+    return pending;
+}
+
+void harddoom2_wait_flushed(struct harddoom2* hd2) {
+    wait_event(hd2->flush_wq, !harddoom2_flush_pending(hd2));
+}
+
+bool harddoom2_poll_flushed(struct harddoom2* hd2, struct file* file, struct poll_table_struct* wait) {
+    poll_wait(file, &hd2->flush_wq, wait);
+    return harddoom2_flush_pending(hd2);
+}
+
+void harddoom2_flush_done(struct harddoom2* hd2) {
+    wake_up_all(&hd2->flush_wq);
+}
+
+struct eventfd_waiter {
+    struct fence_waiter w;
+    struct eventfd_ctx* efd;
+};
+
+static void signal_eventfd_waiter(struct fence_waiter* w) {
+    struct eventfd_waiter* waiter = container_of(w, struct eventfd_waiter, w);
+
+    eventfd_signal(waiter->efd, 1);
+    eventfd_ctx_put(waiter->efd);
+    kfree(waiter);
+}
+
+int harddoom2_fence_eventfd(struct harddoom2* hd2, counter cnt, int fd) {
+    if (cnt > READ_ONCE(hd2->batch_cnt)) {
+        DEBUG("fence_eventfd: fence not submitted yet");
+        return -EINVAL;
+    }
+
+    struct eventfd_ctx* efd = eventfd_ctx_fdget(fd);
+    if (IS_ERR(efd)) {
+        DEBUG("fence_eventfd: wrong fd");
+        return PTR_ERR(efd);
+    }
+
+    struct eventfd_waiter* waiter = kmalloc(sizeof(struct eventfd_waiter), GFP_KERNEL);
+    if (!waiter) {
+        eventfd_ctx_put(efd);
+        return -ENOMEM;
+    }
+    init_fence_waiter(&waiter->w, signal_eventfd_waiter);
+    waiter->efd = efd;
+
+    /* The waiter frees itself when signalled. */
+    arm_fence_waiter(hd2, &waiter->w, cnt);
+
+    return 0;
 }
 
 static void collect_buffers(struct harddoom2* hd2) {
-    counter cnt = get_curr_fence_cnt(hd2);
+    if (list_empty(&hd2->changes_queue)) {
+        return;
+    }
+
+    /* Only read FENCE_COUNTER if the last known value isn't enough to release anything. */
+    counter cnt = get_last_fence_cnt(hd2);
+    if (cnt < list_first_entry(&hd2->changes_queue, struct buffer_change, list)->batch_cnt) {
+        cnt = get_curr_fence_cnt(hd2);
+    }
+
     while (!list_empty(&hd2->changes_queue)) {
         struct buffer_change* change = list_first_entry(&hd2->changes_queue, struct buffer_change, list);
 
@@ -381,120 +877,954 @@ static void collect_buffers(struct harddoom2* hd2) {
     }
 }
 
-static uint32_t get_cmd_buf_space(struct harddoom2* hd2) {
-    /* CMD_BUF_LEN has to be a power of 2 so that the below calculation is correct. */
-    _Static_assert(CMD_BUF_LEN && !(CMD_BUF_LEN & (CMD_BUF_LEN - 1)), "cmd buf len");
+/* CMD_BUF_LEN has to be a power of 2 so that the below calculations are correct. */
+_Static_assert(CMD_BUF_LEN && !(CMD_BUF_LEN & (CMD_BUF_LEN - 1)), "cmd buf len");
 
-    spin_lock(&hd2->write_idx_lock);
-    uint32_t ret = (ioread32(hd2->bar + HARDDOOM2_CMD_READ_IDX)
-            - ioread32(hd2->bar + HARDDOOM2_CMD_WRITE_IDX) - 1) % CMD_BUF_LEN;
-    spin_unlock(&hd2->write_idx_lock);
-    return ret;
+/* Free space in the command buffer, as far as writers are concerned: only SCHED_DEPTH slots are used at once. */
+static uint32_t cmd_buf_space(uint32_t read_idx, uint32_t reserve_idx) {
+    uint32_t used = (reserve_idx - read_idx) % CMD_BUF_LEN;
+    return used < SCHED_DEPTH - 1 ? SCHED_DEPTH - 1 - used : 0;
+}
+
+/* Returns the free space in the command buffer, reading READ_IDX only if the cached value
+   leaves less than 'wanted' free slots. Reserved slots count as used.
+   Must be called with cmd_buff_lock held. */
+static uint32_t get_cmd_buf_space(struct harddoom2* hd2, uint32_t wanted) {
+    uint32_t space = cmd_buf_space(hd2->read_idx, hd2->reserve_idx);
+    if (space >= wanted) {
+        return space;
+    }
+
+    /* The device only moves READ_IDX forward, so the cached value is a lower bound on the space. */
+    hd2->read_idx = hd2_ioread(hd2, HARDDOOM2_CMD_READ_IDX);
+    return cmd_buf_space(hd2->read_idx, hd2->reserve_idx);
+}
+
+/* Can be called without cmd_buff_lock. */
+static bool cmd_buf_has_space(struct harddoom2* hd2, uint32_t wanted) {
+    return cmd_buf_space(hd2_ioread(hd2, HARDDOOM2_CMD_READ_IDX), READ_ONCE(hd2->reserve_idx)) >= wanted;
+}
+
+/* Record batch 'fence' (later than the ones already recorded) of estimated cost 'cost'. */
+static void cost_add(struct cost_tracker* t, counter fence, uint64_t cost) {
+    t->submitted += cost;
+
+    if (t->num_marks == COST_MARKS) {
+        /* Only makes the last mark pass later. */
+        unsigned last = (t->first_mark + COST_MARKS - 1) % COST_MARKS;
+        t->marks[last].fence = fence;
+        t->marks[last].submitted = t->submitted;
+        return;
+    }
+
+    unsigned next = (t->first_mark + t->num_marks++) % COST_MARKS;
+    t->marks[next].fence = fence;
+    t->marks[next].submitted = t->submitted;
+}
+
+/* Given that the device has passed fence 'passed', returns 0 if the cost in flight is below 'max_cost',
+   otherwise the fence that has to pass for it to be. */
+static counter cost_wait_fence(struct cost_tracker* t, counter passed, uint64_t max_cost) {
+    while (t->num_marks && t->marks[t->first_mark].fence <= passed) {
+        t->completed = t->marks[t->first_mark].submitted;
+        t->first_mark = (t->first_mark + 1) % COST_MARKS;
+        --t->num_marks;
+    }
+
+    if (t->submitted - t->completed < max_cost) {
+        return 0;
+    }
+
+    unsigned i;
+    for (i = 0; i + 1 < t->num_marks; ++i) {
+        unsigned mark = (t->first_mark + i) % COST_MARKS;
+        if (t->submitted - t->marks[mark].submitted < max_cost) {
+            break;
+        }
+    }
+    return t->marks[(t->first_mark + i) % COST_MARKS].fence;
+}
+
+void init_sched_entity(struct sched_entity* se) {
+    memset(se, 0, sizeof(struct sched_entity));
+    se->priority = DOOMDEV2_PRIORITY_NORMAL;
+    se->weight = DOOMDEV2_WEIGHT_DEFAULT;
+    INIT_LIST_HEAD(&se->list);
+}
+
+/* Returns 0 if the cost of the published batches allows sending more, otherwise the fence to wait for.
+   Can be called without cmd_buff_lock. */
+static counter device_cost_wait_fence(struct harddoom2* hd2) {
+    counter passed = get_last_fence_cnt(hd2);
+    spin_lock(&hd2->publish_lock);
+    counter fence = cost_wait_fence(&hd2->cost, passed, DEVICE_COST_MAX);
+    spin_unlock(&hd2->publish_lock);
+    return fence;
+}
+
+/* Would sending with 'bufs' need a SETUP loading some buffers? Must be called with cmd_buff_lock held. */
+static bool needs_setup(struct harddoom2* hd2, struct hd2_buffer* const bufs[NUM_USER_BUFS]) {
+    int i;
+    for (i = 0; i < NUM_USER_BUFS; ++i) {
+        if (bufs[i] && bufs[i] != hd2->curr_bufs[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Choose the writer to go next: the first one in the queue, unless it has waited for less than
+   the coalescing window and a writer of the same priority can reuse the installed buffers.
+   Must be called with cmd_buff_lock held. */
+static void sched_pick(struct harddoom2* hd2) {
+    struct sched_entity* first = list_first_entry_or_null(&hd2->sched_queue, struct sched_entity, list);
+    struct sched_entity* next = first;
+
+    if (first && needs_setup(hd2, first->bufs) && ktime_get_ns() - first->enqueue_ns < READ_ONCE(hd2->coalesce_ns)) {
+        struct sched_entity* pos = first;
+        list_for_each_entry_continue(pos, &hd2->sched_queue, list) {
+            if (pos->priority != first->priority) {
+                break;
+            }
+            if (!needs_setup(hd2, pos->bufs)) {
+                next = pos;
+                break;
+            }
+        }
+    }
+
+    WRITE_ONCE(hd2->sched_head, next);
+}
+
+/* Queue 'se', which wants to send with 'bufs'. Must be called with cmd_buff_lock held. */
+static void sched_enqueue(struct harddoom2* hd2, struct sched_entity* se, struct hd2_buffer* bufs[NUM_USER_BUFS]) {
+    se->bufs = bufs;
+    se->enqueue_ns = ktime_get_ns();
+
+    /* A writer that was idle doesn't get to catch up on the time it didn't use. */
+    if (se->vtime < hd2->sched_vtime) {
+        se->vtime = hd2->sched_vtime;
+    }
+
+    struct sched_entity* pos;
+    list_for_each_entry(pos, &hd2->sched_queue, list) {
+        if (pos->priority < se->priority || (pos->priority == se->priority && pos->vtime > se->vtime)) {
+            break;
+        }
+    }
+    list_add_tail(&se->list, &pos->list);
+
+    sched_pick(hd2);
+}
+
+/* Take 'se' off the queue, charging it for 'num_cmds' commands, and let the next writer in.
+   Must be called with cmd_buff_lock held. */
+static void sched_dequeue(struct harddoom2* hd2, struct sched_entity* se, size_t num_cmds) {
+    list_del_init(&se->list);
+    sched_pick(hd2);
+
+    if (num_cmds) {
+        hd2->sched_vtime = se->vtime;
+        se->vtime += num_cmds * SCHED_VTIME_UNIT / se->weight;
+    }
+
+    wake_up_all(&hd2->write_wq);
+}
+
+static bool too_many_reserved(struct harddoom2* hd2) {
+    return READ_ONCE(hd2->batch_cnt) - READ_ONCE(hd2->published_cnt) >= MAX_RESERVED;
+}
+
+/* Must be called with publish_lock held, or when nobody else can write. */
+static void set_write_idx(struct harddoom2* hd2, uint32_t write_idx) {
+    hd2->write_idx = write_idx;
+    hd2_iowrite(hd2, write_idx, HARDDOOM2_CMD_WRITE_IDX);
+}
+
+static uint32_t ping_flag(uint32_t write_idx) {
+    return (write_idx % PING_PERIOD) ? 0 : HARDDOOM2_CMD_FLAG_PING_ASYNC;
+}
+
+static void _set_intr_enable(struct harddoom2* hd2, uint32_t intr_enable) {
+    if (intr_enable != hd2->intr_enable) {
+        hd2->intr_enable = intr_enable;
+        hd2_iowrite(hd2, intr_enable, HARDDOOM2_INTR_ENABLE);
+    }
 }
 
 static void _enable_intr(struct harddoom2* hd2, uint32_t intr) {
-    iowrite32(ioread32(hd2->bar + HARDDOOM2_INTR_ENABLE) | intr, hd2->bar + HARDDOOM2_INTR_ENABLE);
+    _set_intr_enable(hd2, hd2->intr_enable | intr);
 }
 
 static void _disable_intr(struct harddoom2* hd2, uint32_t intr) {
-    iowrite32(ioread32(hd2->bar + HARDDOOM2_INTR_ENABLE) & ~intr, hd2->bar + HARDDOOM2_INTR_ENABLE);
+    _set_intr_enable(hd2, hd2->intr_enable & ~intr);
 }
 
 static void deactivate_intr(struct harddoom2* hd2, uint32_t intr) {
     unsigned long flags;
     spin_lock_irqsave(&hd2->intr_flags_lock, flags);
-    iowrite32(intr, hd2->bar + HARDDOOM2_INTR);
+    hd2_iowrite(hd2, intr, HARDDOOM2_INTR);
     spin_unlock_irqrestore(&hd2->intr_flags_lock, flags);
 }
 
-ssize_t harddoom2_write(struct harddoom2* hd2, struct hd2_buffer* bufs[NUM_USER_BUFS],
-        const struct doomdev2_cmd* cmds, size_t num_cmds) {
-    update_last_fence_cnt(hd2);
+/* Copy 'num' commands starting at 'pos' in 'src' to 'cmds'. Returns 0 or negative error code. */
+static int fetch_cmds(const struct cmd_source* src, size_t pos, struct doomdev2_cmd* cmds, size_t num) {
+    BUG_ON(pos + num > src->num_cmds);
+
+    if (src->user_cmds) {
+        if (copy_from_user(cmds, src->user_cmds + pos, num * sizeof(struct doomdev2_cmd))) {
+            DEBUG("write: copy from user fail");
+            return -EFAULT;
+        }
+        return 0;
+    }
+
+    if (src->iter) {
+        /* Copies straight out of the iterator's pages (of the page cache or a pipe, for splice). */
+        struct iov_iter iter = *src->iter;
+        iov_iter_advance(&iter, pos * sizeof(struct doomdev2_cmd));
+        if (!copy_from_iter_full(cmds, num * sizeof(struct doomdev2_cmd), &iter)) {
+            DEBUG("write: copy from iter fail");
+            return -EFAULT;
+        }
+        return 0;
+    }
+
+    memcpy(cmds, src->kern_cmds + pos, num * sizeof(struct doomdev2_cmd));
+    return 0;
+}
+
+/* Slots of the command buffer reserved for a batch. */
+struct reservation {
+    counter fence;
+
+    /* Slots for the commands (after the SETUP, if the batch needed one). */
+    uint32_t start;
+    uint32_t num_slots;
+
+    /* Fills the slots the batch doesn't use: a SETUP which doesn't change anything. */
+    struct cmd nop;
+
+    /* The surfaces the batch writes and reads (or NULL), and the earlier writes to the source one
+       which no INTERLOCK covers. */
+    struct hd2_buffer* dst;
+    struct hd2_buffer* src;
+    struct region src_dirty;
+
+    /* The batch was sent through CMD_SEND and is already published. */
+    bool direct;
+};
+
+/* Decides which COPY_RECTs of a batch being encoded need an INTERLOCK: those whose source rectangle
+   meets a write that no earlier INTERLOCK covers. */
+struct interlock_tracker {
+    struct hd2_buffer* src;
+    bool src_is_dst;
+    /* Writes of earlier batches to the source surface. */
+    struct region src_dirty;
+    /* Writes of this batch to the destination surface, since its last INTERLOCK if that's also the source. */
+    struct region written;
+    bool used;
+};
+
+static void init_interlock_tracker(struct interlock_tracker* tracker, const struct reservation* res) {
+    tracker->src = res->src;
+    tracker->src_is_dst = res->src == res->dst;
+    tracker->src_dirty = res->src_dirty;
+    region_init(&tracker->written);
+    tracker->used = false;
+}
+
+/* Returns the flags 'cmd' needs to read what the batch and the earlier ones wrote, and adds its writes. */
+static uint32_t track_cmd(struct interlock_tracker* tracker, const struct doomdev2_cmd* cmd) {
+    uint32_t flags = 0;
+    struct rect rect;
+
+    if (cmd->type == DOOMDEV2_CMD_TYPE_COPY_RECT) {
+        copy_src_rect(cmd, &rect);
+        if (region_intersects(&tracker->src_dirty, &rect)
+                || (tracker->src_is_dst && region_intersects(&tracker->written, &rect))) {
+            flags = HARDDOOM2_CMD_FLAG_INTERLOCK;
+            tracker->used = true;
+            /* The INTERLOCK waits for everything before it. */
+            region_init(&tracker->src_dirty);
+            if (tracker->src_is_dst) {
+                region_init(&tracker->written);
+            }
+        }
+    }
+
+    cmd_dst_rect(cmd, &rect);
+    region_add(&tracker->written, &rect);
+    return flags;
+}
+
+/* The pixels an encoded COPY_RECT reads. */
+static void encoded_copy_src_rect(const struct cmd* cmd, struct rect* rect) {
+    uint16_t x = HARDDOOM2_CMD_W2_W3_EXTR_X(cmd->data[3]), y = HARDDOOM2_CMD_W2_W3_EXTR_Y(cmd->data[3]);
+    rect->x0 = x;
+    rect->y0 = y;
+    rect->x1 = x + HARDDOOM2_CMD_W6_A_EXTR_WIDTH(cmd->data[6]);
+    rect->y1 = y + HARDDOOM2_CMD_W6_A_EXTR_HEIGHT(cmd->data[6]);
+}
+
+/* Record the interlock and the writes of the encoded batch 'res' in its buffers. */
+static void track_batch(const struct reservation* res, const struct interlock_tracker* tracker) {
+    if (tracker->used) {
+        interlock(res->src, res->fence);
+    }
+    end_write(res->dst, res->fence, &tracker->written);
+}
+
+/* A whole batch already fetched and validated, which may be sent through CMD_SEND. */
+struct direct_batch {
+    const struct bind_limits* limits;
+    struct doomdev2_cmd* cmds;
+    uint64_t cost;
+    bool relaxed;
+};
+
+/* Can a batch of 'num_cmds' commands and a SETUP be sent through CMD_SEND? Only if everything published
+   has finished, as far as the last fence count read says: then the whole command buffer has been fetched,
+   so the batch can't overtake earlier ones, and the FIFO is empty. Doesn't read the device.
+   Must be called with cmd_buff_lock held. */
+static bool can_send_direct(struct harddoom2* hd2, size_t num_cmds) {
+    /* Everything reserved is published: only this writer may reserve and publish_batch moves towards reserve_idx. */
+    if (num_cmds > READ_ONCE(hd2->direct_max_cmds) || hd2->reserve_idx != READ_ONCE(hd2->write_idx)) {
+        return false;
+    }
+    if (get_last_fence_cnt(hd2) < READ_ONCE(hd2->published_cnt)) {
+        return false;
+    }
+    hd2->read_idx = hd2->reserve_idx;
+    return true;
+}
+
+static void send_cmd(struct harddoom2* hd2, const struct cmd* cmd) {
+    /* Writing the last word sends the command. */
+    for (int i = 0; i < HARDDOOM2_CMD_SEND_SIZE; ++i) {
+        hd2_iowrite(hd2, cmd->data[i], HARDDOOM2_CMD_SEND(i));
+    }
+}
+
+/* Send the batch 'res' straight to the FIFO, preceded by a SETUP of 'setup_mask' if it's not 0,
+   and publish it. Must be called with cmd_buff_lock held, after can_send_direct. */
+static void send_direct(struct harddoom2* hd2, const struct direct_batch* direct, size_t num_cmds,
+        unsigned setup_mask, struct reservation* res) {
+    if (setup_mask) {
+        struct cmd dev_cmd = make_setup(hd2->curr_bufs, setup_mask, 0);
+        send_cmd(hd2, &dev_cmd);
+    }
+
+    if (direct->relaxed) {
+        reorder_cmds(direct->cmds, num_cmds);
+    }
+
+    struct interlock_tracker tracker;
+    init_interlock_tracker(&tracker, res);
+    for (size_t it = 0; it < num_cmds; ++it) {
+        uint32_t flags = it + 1 == num_cmds ? HARDDOOM2_CMD_FLAG_FENCE : 0;
+        flags |= track_cmd(&tracker, &direct->cmds[it]);
+        struct cmd dev_cmd = make_cmd(direct->limits, &direct->cmds[it], flags);
+        send_cmd(hd2, &dev_cmd);
+    }
+    track_batch(res, &tracker);
+
+    spin_lock(&hd2->publish_lock);
+    WRITE_ONCE(hd2->batch_submit_ns[res->fence % BATCH_TIMES], ktime_get_ns());
+    cost_add(&hd2->cost, res->fence, direct->cost);
+    WRITE_ONCE(hd2->published_cnt, res->fence);
+    spin_unlock(&hd2->publish_lock);
+
+    ++hd2->direct_cnt;
+    res->direct = true;
+}
+
+/* Reserve room for up to 'num_cmds' commands, and at least 'min_cmds', using buffers 'bufs' and make the device
+   state (installed buffers, fences, buffer uses) look as if they were already sent.
+   Only this is serialized between writers. If 'direct' is set and the device is idle, sends it right away instead.
+   Returns 0 or negative error code. */
+static int reserve_batch(struct harddoom2* hd2, struct hd2_buffer* bufs[NUM_USER_BUFS], size_t num_cmds,
+        size_t min_cmds, const struct direct_batch* direct, struct sched_entity* se, bool nonblock,
+        struct reservation* res) {
+    /* Waiting for our own batches doesn't hold anyone else up. 'se' belongs to the caller. */
+    counter busy_fence;
+    while ((busy_fence = cost_wait_fence(&se->cost, get_last_fence_cnt(hd2), CONTEXT_COST_MAX))) {
+        if (nonblock) {
+            return -EAGAIN;
+        }
+        wait_for_fence_cnt(hd2, busy_fence, 0);
+    }
 
     mutex_lock(&hd2->cmd_buff_lock);
-    while (get_cmd_buf_space(hd2) < 2) {
-        deactivate_intr(hd2, HARDDOOM2_INTR_PONG_ASYNC);
-        if (get_cmd_buf_space(hd2) >= 2) {
-            break;
+    sched_enqueue(hd2, se, bufs);
+
+    /* If there is room for the whole batch and a SETUP, there's no need to look at the device. */
+    uint32_t wanted = min_t(size_t, num_cmds + 1, SCHED_DEPTH - 1);
+    uint32_t needed = min_cmds + 1;
+    BUG_ON(!min_cmds || min_cmds > num_cmds || needed > wanted);
+    uint32_t space = get_cmd_buf_space(hd2, wanted);
+    while (hd2->sched_head != se || space < needed || too_many_reserved(hd2)
+            || (busy_fence = device_cost_wait_fence(hd2))) {
+        if (nonblock) {
+            sched_dequeue(hd2, se, 0);
+            mutex_unlock(&hd2->cmd_buff_lock);
+            return -EAGAIN;
         }
-        _enable_intr(hd2, HARDDOOM2_INTR_PONG_ASYNC);
-        mutex_unlock(&hd2->cmd_buff_lock);
 
-        wait_event(hd2->write_wq, get_cmd_buf_space(hd2) >= 2);
+        if (hd2->sched_head != se) {
+            mutex_unlock(&hd2->cmd_buff_lock);
+
+            wait_event(hd2->write_wq, READ_ONCE(hd2->sched_head) == se);
+        } else if (space < needed) {
+            deactivate_intr(hd2, HARDDOOM2_INTR_PONG_ASYNC);
+            if ((space = get_cmd_buf_space(hd2, wanted)) >= needed) {
+                continue;
+            }
+            _enable_intr(hd2, HARDDOOM2_INTR_PONG_ASYNC);
+            mutex_unlock(&hd2->cmd_buff_lock);
+
+            wait_event(hd2->write_wq, cmd_buf_has_space(hd2, needed));
+        } else if (too_many_reserved(hd2)) {
+            mutex_unlock(&hd2->cmd_buff_lock);
+
+            wait_event(hd2->publish_wq, !too_many_reserved(hd2));
+        } else {
+            /* The device is busy enough; everyone else waits behind us anyway. */
+            mutex_unlock(&hd2->cmd_buff_lock);
+
+            wait_for_fence_cnt(hd2, busy_fence, 0);
+        }
 
         mutex_lock(&hd2->cmd_buff_lock);
+        space = get_cmd_buf_space(hd2, wanted);
     }
 
     _disable_intr(hd2, HARDDOOM2_INTR_PONG_ASYNC);
-    /* If anyone was waiting on the event queue, let them enable the interrupt again. */
-    wake_up_all(&hd2->write_wq);
 
-    uint32_t space = get_cmd_buf_space(hd2);
-
-    spin_lock(&hd2->write_idx_lock);
-    uint32_t write_idx = ioread32(hd2->bar + HARDDOOM2_CMD_WRITE_IDX);
-    spin_unlock(&hd2->write_idx_lock);
-
-    uint32_t extra_flags = (write_idx % PING_PERIOD) ? 0 : HARDDOOM2_CMD_FLAG_PING_ASYNC;
+    uint32_t write_idx = hd2->reserve_idx;
 
     int set = update_buffers(hd2, bufs);
     if (set < 0) {
         DEBUG("write: could not setup");
-        goto out_setup;
-    } else if (set) {
-        struct cmd dev_cmd = make_setup(hd2->curr_bufs, extra_flags);
-        write_cmd(hd2, &dev_cmd, write_idx);
-
-        write_idx = (write_idx + 1) % CMD_BUF_LEN;
-        extra_flags = (write_idx % PING_PERIOD) ? 0 : HARDDOOM2_CMD_FLAG_PING_ASYNC;
-        --space;
+        sched_dequeue(hd2, se, 0);
+        mutex_unlock(&hd2->cmd_buff_lock);
+        return set;
     }
-
-    if (num_cmds > space) {
-        num_cmds = space;
+    if (set) {
+        ++hd2->setup_cnt;
     }
 
-    BUG_ON(!num_cmds);
-
-    for (size_t it = 0; it < num_cmds - 1; ++it) {
-        struct cmd dev_cmd = make_cmd(hd2, &cmds[it], extra_flags);
+    bool send_now = direct && can_send_direct(hd2, num_cmds);
+    if (set && !send_now) {
+        struct cmd dev_cmd = make_setup(hd2->curr_bufs, set, ping_flag(write_idx));
         write_cmd(hd2, &dev_cmd, write_idx);
 
         write_idx = (write_idx + 1) % CMD_BUF_LEN;
-        extra_flags = (write_idx % PING_PERIOD) ? 0 : HARDDOOM2_CMD_FLAG_PING_ASYNC;
+        --space;
     }
 
-    extra_flags |= HARDDOOM2_CMD_FLAG_FENCE;
-    struct cmd dev_cmd = make_cmd(hd2, &cmds[num_cmds - 1], extra_flags);
-    write_cmd(hd2, &dev_cmd, write_idx);
+    res->start = write_idx;
+    res->num_slots = send_now ? num_cmds : min_t(size_t, num_cmds, space);
+    res->nop = make_setup(hd2->curr_bufs, 0, 0);
+    res->fence = ++hd2->batch_cnt;
+    res->direct = false;
 
-    write_idx = (write_idx + 1) % CMD_BUF_LEN;
-    ++hd2->batch_cnt;
+    if (!send_now) {
+        hd2->reserve_idx = (write_idx + res->num_slots) % CMD_BUF_LEN;
+        hd2->reserved_end[res->fence % MAX_RESERVED] = hd2->reserve_idx;
+    }
 
-    spin_lock(&hd2->write_idx_lock);
-    iowrite32(write_idx, hd2->bar + HARDDOOM2_CMD_WRITE_IDX);
-    spin_unlock(&hd2->write_idx_lock);
+    /* Taken before our own writes: the batch tracks those itself. */
+    res->dst = hd2->curr_bufs[DST_BUF_IDX];
+    res->src = hd2->curr_bufs[SRC_BUF_IDX];
+    region_init(&res->src_dirty);
+    if (res->src) {
+        get_dirty_region(res->src, &res->src_dirty);
+    }
 
-    set_last_write(hd2->curr_bufs[DST_BUF_IDX], hd2->batch_cnt);
+    begin_write(res->dst, res->fence);
 
     /* 'last use' is needed by the driver to wait until commands using this buffer finish
        when the user wants to write to this buffer. Since the user doesn't do that very often,
        we don't care to set last use on specific buffers only - we set it on all installed buffers. */
     for (int i = 0; i < NUM_USER_BUFS; ++i) {
         if (hd2->curr_bufs[i]) {
-            set_last_use(hd2->curr_bufs[i], hd2->batch_cnt);
+            set_last_use(hd2->curr_bufs[i], res->fence);
         }
     }
 
+    /* FENCE_COUNTER is only 32 bits wide, we have to look at it often enough
+       to notice when it wraps around, even if nobody waits for anything. */
+    if (!(res->fence % FENCE_REFRESH_PERIOD)) {
+        update_last_fence_cnt(hd2);
+    }
+
+    if (send_now) {
+        send_direct(hd2, direct, num_cmds, set, res);
+    }
+
     collect_buffers(hd2);
 
+    /* The next writer may go, and if it was waiting for space, enable the interrupt again. */
+    sched_dequeue(hd2, se, res->num_slots);
+
     mutex_unlock(&hd2->cmd_buff_lock);
+    return 0;
+}
 
-    return num_cmds;
+/* Mark the batch with fence 'fence' and estimated cost 'cost' as encoded and hand all the encoded batches
+   which follow the already published ones to the device, with a single WRITE_IDX write.
+   If an earlier batch is still being encoded, its writer will publish this one too. */
+static void publish_batch(struct harddoom2* hd2, counter fence, uint64_t cost) {
+    spin_lock(&hd2->publish_lock);
+    hd2->encoded[fence % MAX_RESERVED] = true;
+    hd2->batch_cost[fence % MAX_RESERVED] = cost;
+
+    uint32_t write_idx = hd2->write_idx;
+    while (hd2->encoded[(hd2->published_cnt + 1) % MAX_RESERVED]) {
+        counter next = hd2->published_cnt + 1;
+        hd2->encoded[next % MAX_RESERVED] = false;
+        write_idx = hd2->reserved_end[next % MAX_RESERVED];
+        cost_add(&hd2->cost, next, hd2->batch_cost[next % MAX_RESERVED]);
+        WRITE_ONCE(hd2->batch_submit_ns[next % BATCH_TIMES], ktime_get_ns());
+        WRITE_ONCE(hd2->published_cnt, next);
+    }
 
-out_setup:
-    mutex_unlock(&hd2->cmd_buff_lock);
-    return set;
+    if (write_idx != hd2->write_idx) {
+        set_write_idx(hd2, write_idx);
+    }
+    spin_unlock(&hd2->publish_lock);
+
+    wake_up_all(&hd2->publish_wq);
+}
+
+/* Set FENCE on the last slot of the encoded batch 'res' of estimated cost 'cost', record its interlock
+   and writes, and publish it. */
+static void finish_batch(struct harddoom2* hd2, struct sched_entity* se, const struct reservation* res,
+        const struct interlock_tracker* tracker, uint64_t cost) {
+    uint32_t end_idx = (res->start + res->num_slots) % CMD_BUF_LEN;
+    cmd_slot(hd2, (end_idx + CMD_BUF_LEN - 1) % CMD_BUF_LEN)->data[0] |= HARDDOOM2_CMD_FLAG_FENCE;
+    sync_cmd_slots(hd2, res->start, res->num_slots);
+
+    track_batch(res, tracker);
+
+    cost_add(&se->cost, res->fence, cost);
+    publish_batch(hd2, res->fence, cost);
+}
+
+ssize_t harddoom2_write(struct harddoom2* hd2, struct hd2_buffer* bufs[NUM_USER_BUFS],
+        const struct bind_limits* limits, const struct cmd_source* src, struct doomdev2_cmd* staging,
+        struct sched_entity* se, bool nonblock, counter* fence) {
+    size_t num_cmds = min_t(size_t, src->num_cmds, MAX_WRITE_CMDS);
+    ssize_t err = 0;
+
+    BUG_ON(!num_cmds);
+    lockdep_assert_not_held(&hd2->cmd_buff_lock);
+
+    /* Copy and validate the whole batch before reserving anything: an invalid batch leaves no trace,
+       and nothing that may fault is done while other writers wait for our reservation to be published.
+       Commands are validated after they're copied, so that the user can't change them before they're encoded.
+       Only the commands up to the first chunk that can't be fetched are sent. */
+    size_t num_fetched = 0;
+    while (num_fetched < num_cmds) {
+        size_t num_chunk = min_t(size_t, num_cmds - num_fetched, FETCH_CMDS);
+        if ((err = fetch_cmds(src, num_fetched, staging + num_fetched, num_chunk))) {
+            break;
+        }
+        num_fetched += num_chunk;
+    }
+    if (!num_fetched) {
+        return err;
+    }
+    size_t num_valid = validate_cmds(limits, staging, num_fetched);
+    if (!num_valid) {
+        return -EINVAL;
+    }
+    uint64_t cost = 0;
+    num_valid = cmds_within_cost(staging, num_valid, &cost, BATCH_COST_MAX);
+
+    /* Cull a window at a time, moving the commands left to the front, so that the dropped ones take no slots
+       and don't count towards the cost. 'window_kept' remembers how many each window kept: a reservation
+       too short for all of them ends at a window boundary, since a dropped command may be covered
+       by a later one of its window. */
+    uint8_t window_kept[MAX_WRITE_CMDS / FETCH_CMDS];
+    size_t num_windows = DIV_ROUND_UP(num_valid, FETCH_CMDS);
+    size_t num_kept = 0;
+    uint64_t culled = 0;
+    for (size_t w = 0; w < num_windows; ++w) {
+        struct doomdev2_cmd* cmds = staging + w * FETCH_CMDS;
+        size_t num_window = min_t(size_t, num_valid - w * FETCH_CMDS, FETCH_CMDS);
+        size_t kept = num_window;
+        if (src->cull) {
+            uint64_t window_cost = 0;
+            for (size_t it = 0; it < num_window; ++it) {
+                window_cost += cmd_cost(&cmds[it]);
+            }
+            kept = cull_cmds(limits, cmds, num_window, &culled);
+            for (size_t it = 0; it < kept; ++it) {
+                window_cost -= cmd_cost(&cmds[it]);
+            }
+            cost -= window_cost;
+        }
+        if (cmds != staging + num_kept) {
+            memmove(staging + num_kept, cmds, kept * sizeof(struct doomdev2_cmd));
+        }
+        window_kept[w] = kept;
+        num_kept += kept;
+    }
+
+    /* A small batch that's all in hand may skip the command buffer. */
+    struct direct_batch direct = { .limits = limits, .cmds = staging, .cost = cost, .relaxed = src->relaxed };
+    bool can_direct = num_valid == src->num_cmds && num_kept <= SEND_MAX_CMDS;
+
+    struct reservation res;
+    if ((err = reserve_batch(hd2, bufs, num_kept, window_kept[0], can_direct ? &direct : NULL, se, nonblock,
+            &res))) {
+        return err;
+    }
+    if (culled) {
+        atomic64_add(culled, &hd2->culled_pixels);
+    }
+
+    if (res.direct) {
+        cost_add(&se->cost, res.fence, cost);
+        *fence = res.fence;
+        return num_valid;
+    }
+
+    if (res.num_slots < num_kept) {
+        size_t used = 0;
+        size_t w = 0;
+        while (used + window_kept[w] <= res.num_slots) {
+            used += window_kept[w++];
+        }
+        for (size_t it = used; it < num_kept; ++it) {
+            cost -= cmd_cost(&staging[it]);
+        }
+        num_windows = w;
+        num_kept = used;
+        num_valid = w * FETCH_CMDS;
+    }
+
+    /* Encode the commands straight into the reserved slots, a window at a time.
+       Other writers encode their own batches at the same time. */
+    uint32_t write_idx = res.start;
+    struct cmd* slot = cmd_slot(hd2, write_idx);
+    struct interlock_tracker tracker;
+    init_interlock_tracker(&tracker, &res);
+    struct doomdev2_cmd* cmds = staging;
+    for (size_t w = 0; w < num_windows; ++w) {
+        if (src->relaxed) {
+            reorder_cmds(cmds, window_kept[w]);
+        }
+        for (size_t it = 0; it < window_kept[w]; ++it) {
+            *slot = make_cmd(limits, &cmds[it], ping_flag(write_idx) | track_cmd(&tracker, &cmds[it]));
+            ++slot;
+            if (++write_idx == CMD_BUF_LEN) {
+                write_idx = 0;
+                slot = cmd_slot(hd2, 0);
+            }
+        }
+        cmds += window_kept[w];
+    }
+
+    /* The rest of the reservation can't be given back, since later batches may already be behind it. */
+    for (size_t it = num_kept; it < res.num_slots; ++it) {
+        *slot = res.nop;
+        slot->data[0] |= ping_flag(write_idx);
+        ++slot;
+        if (++write_idx == CMD_BUF_LEN) {
+            write_idx = 0;
+            slot = cmd_slot(hd2, 0);
+        }
+    }
+
+    finish_batch(hd2, se, &res, &tracker, cost);
+
+    *fence = res.fence;
+    return num_valid;
+}
+
+/* A command list validated and encoded once, see harddoom2_record_list. */
+struct cmd_list {
+    /* What the commands were validated against. They're replayed only with the same limits. */
+    struct bind_limits limits;
+
+    size_t num_cmds;
+    /* Encoded without PING_ASYNC and FENCE flags, which depend on where they end up. COPY_RECTs reading
+       what earlier commands of the list wrote have an INTERLOCK; those reading earlier batches get it when sent. */
+    struct cmd* cmds;
+    /* Estimated cost of each command. */
+    uint32_t* costs;
+    /* Everything the commands may write. */
+    struct region written;
+};
+
+/* Validate and encode commands [start, end) of 'src' into 'list', adding what they write to 'written'.
+   If 'partial' is set, stops at the first command that can't be fetched, like at an invalid one.
+   Returns the length of the valid prefix or negative error code. */
+static ssize_t encode_list_part(struct cmd_list* list, const struct bind_limits* limits,
+        const struct cmd_source* src, size_t start, size_t end, bool partial, struct region* written) {
+    struct doomdev2_cmd cmds[FETCH_CMDS];
+
+    /* Only conflicts within the list are tracked here. A part not at the start of the list doesn't know
+       what the commands before it write, so its first COPY_RECT within one surface waits for all of them. */
+    struct interlock_tracker tracker = { .src_is_dst = limits->src_is_dst };
+    region_init(&tracker.src_dirty);
+    region_init(&tracker.written);
+    if (start && limits->src_is_dst) {
+        struct rect everything = { 0, 0, U16_MAX, U16_MAX };
+        region_add(&tracker.src_dirty, &everything);
+    }
+
+    for (size_t pos = start; pos < end; pos += FETCH_CMDS) {
+        size_t num_fetched = min_t(size_t, end - pos, FETCH_CMDS);
+        int err = fetch_cmds(src, pos, cmds, num_fetched);
+        if (err) {
+            return partial && pos > start ? pos - start : err;
+        }
+        size_t num_valid = validate_cmds(limits, cmds, num_fetched);
+        if (src->relaxed) {
+            reorder_cmds(cmds, num_valid);
+        }
+
+        for (size_t it = 0; it < num_valid; ++it) {
+            struct rect rect;
+            list->cmds[pos + it] = make_cmd(limits, &cmds[it], track_cmd(&tracker, &cmds[it]));
+            list->costs[pos + it] = cmd_cost(&cmds[it]);
+            cmd_dst_rect(&cmds[it], &rect);
+            region_add(written, &rect);
+        }
+
+        if (num_valid < num_fetched) {
+            return pos + num_valid - start;
+        }
+    }
+
+    return end - start;
+}
+
+/* A part of a long list, encoded by a worker. */
+struct encode_part {
+    struct work_struct work;
+    struct completion done;
+
+    struct cmd_list* list;
+    const struct bind_limits* limits;
+    const struct cmd_source* src;
+    size_t start;
+    size_t end;
+
+    /* Results of encode_list_part. */
+    ssize_t valid;
+    struct region written;
+};
+
+static void encode_part_work(struct work_struct* work) {
+    struct encode_part* part = container_of(work, struct encode_part, work);
+
+    /* The workers' source is in kernel memory, it can't fault. */
+    part->valid = encode_list_part(part->list, part->limits, part->src, part->start, part->end,
+            false, &part->written);
+    complete(&part->done);
+}
+
+/* Validate and encode all of 'src' into 'list', splitting long lists between the CPUs.
+   'partial' is as for encode_list_part. Returns the length of the valid prefix or negative error code. */
+static ssize_t encode_list(struct cmd_list* list, const struct bind_limits* limits, const struct cmd_source* src,
+        bool partial) {
+    size_t num_cmds = src->num_cmds;
+    unsigned num_parts = min_t(size_t, num_online_cpus(), num_cmds / ENCODE_PART_CMDS);
+    if (num_cmds < PARALLEL_ENCODE_MIN_CMDS || num_parts < 2 || src->iter) {
+        return encode_list_part(list, limits, src, 0, num_cmds, partial, &list->written);
+    }
+
+    /* Workers can't read the user's memory, they get a copy. */
+    struct cmd_source kern_src = *src;
+    void* staging = NULL;
+    if (src->user_cmds) {
+        staging = vmemdup_user(src->user_cmds, num_cmds * sizeof(struct doomdev2_cmd));
+        if (IS_ERR(staging)) {
+            /* Some of the commands can't be read (or there's no memory for the copy).
+               Encode them here instead, which takes whatever comes before the first fault. */
+            DEBUG("encode_list: vmemdup_user, encoding serially");
+            return encode_list_part(list, limits, src, 0, num_cmds, partial, &list->written);
+        }
+        kern_src.user_cmds = NULL;
+        kern_src.kern_cmds = staging;
+    }
+
+    ssize_t valid = 0;
+    struct encode_part* parts = kcalloc(num_parts, sizeof(struct encode_part), GFP_KERNEL);
+    if (!parts) {
+        DEBUG("encode_list: kmalloc");
+        valid = -ENOMEM;
+        goto out_staging;
+    }
+
+    unsigned i;
+    for (i = 0; i < num_parts; ++i) {
+        struct encode_part* part = &parts[i];
+        part->list = list;
+        part->limits = limits;
+        part->src = &kern_src;
+        part->start = num_cmds * i / num_parts;
+        part->end = num_cmds * (i + 1) / num_parts;
+        init_completion(&part->done);
+        INIT_WORK(&part->work, encode_part_work);
+    }
+    /* The first part is ours. */
+    for (i = 1; i < num_parts; ++i) {
+        queue_work(system_unbound_wq, &parts[i].work);
+    }
+    encode_part_work(&parts[0].work);
+
+    for (i = 0; i < num_parts; ++i) {
+        wait_for_completion(&parts[i].done);
+    }
+
+    for (i = 0; i < num_parts; ++i) {
+        if (parts[i].valid < 0) {
+            if (!valid) {
+                valid = parts[i].valid;
+            }
+            break;
+        }
+        valid += parts[i].valid;
+        region_add_region(&list->written, &parts[i].written);
+        if (parts[i].valid < parts[i].end - parts[i].start) {
+            break;
+        }
+    }
+
+    kfree(parts);
+out_staging:
+    kvfree(staging);
+    return valid;
+}
+
+struct cmd_list* harddoom2_record_list(const struct bind_limits* limits, const struct cmd_source* src, bool partial) {
+    size_t num_cmds = src->num_cmds;
+    int err;
+
+    if (!num_cmds || num_cmds > MAX_LIST_CMDS) {
+        DEBUG("record_list: wrong length %lu", num_cmds);
+        return ERR_PTR(-EINVAL);
+    }
+
+    struct cmd_list* list = kzalloc(sizeof(struct cmd_list), GFP_KERNEL);
+    if (!list) {
+        DEBUG("record_list: kmalloc");
+        return ERR_PTR(-ENOMEM);
+    }
+
+    memcpy(&list->limits, limits, sizeof(struct bind_limits));
+    list->cmds = kvmalloc_array(num_cmds, sizeof(struct cmd), GFP_KERNEL);
+    list->costs = kvmalloc_array(num_cmds, sizeof(uint32_t), GFP_KERNEL);
+    if (!list->cmds || !list->costs) {
+        DEBUG("record_list: kvmalloc");
+        err = -ENOMEM;
+        goto err_list;
+    }
+
+    ssize_t valid = encode_list(list, limits, src, partial);
+    if (valid < 0) {
+        err = valid;
+        goto err_list;
+    }
+    if (!valid || (!partial && valid < num_cmds)) {
+        DEBUG("record_list: invalid cmd %ld", valid);
+        err = -EINVAL;
+        goto err_list;
+    }
+    list->num_cmds = valid;
+
+    return list;
+
+err_list:
+    harddoom2_free_list(list);
+    return ERR_PTR(err);
+}
+
+size_t list_length(const struct cmd_list* list) {
+    return list->num_cmds;
+}
+
+void harddoom2_free_list(struct cmd_list* list) {
+    kvfree(list->cmds);
+    kvfree(list->costs);
+    kfree(list);
+}
+
+ssize_t harddoom2_write_list(struct harddoom2* hd2, struct hd2_buffer* bufs[NUM_USER_BUFS],
+        const struct bind_limits* limits, const struct cmd_list* list, size_t pos,
+        struct sched_entity* se, bool nonblock, counter* fence) {
+    BUG_ON(pos >= list->num_cmds);
+
+    if (memcmp(limits, &list->limits, sizeof(struct bind_limits))) {
+        DEBUG("write_list: buffers don't match the list");
+        return -EINVAL;
+    }
+
+    uint64_t cost = 0;
+    size_t num_cmds = 0;
+    while (pos + num_cmds < list->num_cmds
+            && (!cost || cost + list->costs[pos + num_cmds] <= BATCH_COST_MAX)) {
+        cost += list->costs[pos + num_cmds++];
+    }
+
+    struct reservation res;
+    ssize_t err;
+    if ((err = reserve_batch(hd2, bufs, num_cmds, 1, NULL, se, nonblock, &res))) {
+        return err;
+    }
+
+    if (res.num_slots < num_cmds) {
+        for (size_t it = res.num_slots; it < num_cmds; ++it) {
+            cost -= list->costs[pos + it];
+        }
+        num_cmds = res.num_slots;
+    }
+
+    /* The batch may wrap around the end of the command buffer. */
+    size_t first_part = min_t(size_t, num_cmds, CMD_BUF_LEN - res.start);
+    memcpy(cmd_slot(hd2, res.start), &list->cmds[pos], first_part * sizeof(struct cmd));
+    memcpy(cmd_slot(hd2, 0), &list->cmds[pos + first_part], (num_cmds - first_part) * sizeof(struct cmd));
+
+    uint32_t next_ping = round_up(res.start, PING_PERIOD);
+    for (size_t it = next_ping - res.start; it < num_cmds; it += PING_PERIOD) {
+        cmd_slot(hd2, (res.start + it) % CMD_BUF_LEN)->data[0] |= HARDDOOM2_CMD_FLAG_PING_ASYNC;
+    }
+
+    /* Conflicts within the list were settled when it was recorded. Only the first COPY_RECT reading
+       an earlier batch's writes needs an INTERLOCK now, unless one of the list's own comes before it.
+       Only the list's extents are kept as its writes. */
+    struct interlock_tracker tracker;
+    init_interlock_tracker(&tracker, &res);
+    tracker.written = list->written;
+    for (size_t it = 0; res.src && it < num_cmds; ++it) {
+        const struct cmd* cmd = &list->cmds[pos + it];
+        if ((cmd->data[0] & HARDDOOM2_CMD_TYPE_MASK) != HARDDOOM2_CMD_TYPE_COPY_RECT) {
+            continue;
+        }
+        if (!(cmd->data[0] & HARDDOOM2_CMD_FLAG_INTERLOCK)) {
+            struct rect rect;
+            encoded_copy_src_rect(cmd, &rect);
+            if (!region_intersects(&tracker.src_dirty, &rect)) {
+                continue;
+            }
+            cmd_slot(hd2, (res.start + it) % CMD_BUF_LEN)->data[0] |= HARDDOOM2_CMD_FLAG_INTERLOCK;
+        }
+        /* The INTERLOCK waits for everything before it. */
+        tracker.used = true;
+        break;
+    }
+
+    finish_batch(hd2, se, &res, &tracker, cost);
+
+    *fence = res.fence;
+    return num_cmds;
 }
 
 int harddoom2_create_surface(struct harddoom2* hd2, struct doomdev2_ioctl_create_surface __user* _params) {
@@ -572,12 +1902,19 @@ typedef void (*doom_irq_handler_t)(struct harddoom2*, uint32_t);
 static void handle_fence(struct harddoom2* hd2, uint32_t bit) {
     DEBUG("handle fence");
 
-    wake_up_all(&hd2->fence_wq);
+    /* One read of FENCE_COUNTER serves both. */
+    counter cnt = sample_batch_time(hd2);
+
+    spin_lock(&hd2->timeline_lock);
+    _process_timeline(hd2, cnt);
+    spin_unlock(&hd2->timeline_lock);
 }
 
 static void handle_pong_async(struct harddoom2* hd2, uint32_t bit) {
     DEBUG("pong_async");
 
+    sample_batch_time(hd2);
+
     wake_up_all(&hd2->write_wq);
 }
 
@@ -605,8 +1942,8 @@ static irqreturn_t doom_irq_handler(int irq, void* _hd2) {
 
     unsigned long flags;
     spin_lock_irqsave(&hd2->intr_flags_lock, flags);
-    uint32_t active = ioread32(hd2->bar + HARDDOOM2_INTR);
-    iowrite32(active, hd2->bar + HARDDOOM2_INTR);
+    uint32_t active = hd2_ioread(hd2, HARDDOOM2_INTR);
+    hd2_iowrite(hd2, active, HARDDOOM2_INTR);
     spin_unlock_irqrestore(&hd2->intr_flags_lock, flags);
 
     int served = 0;
@@ -636,12 +1973,19 @@ static void reset_device(struct harddoom2* hd2) {
     iowrite32(CMD_BUF_LEN, hd2->bar + HARDDOOM2_CMD_SIZE);
     iowrite32(0, hd2->bar + HARDDOOM2_CMD_READ_IDX);
     iowrite32(0, hd2->bar + HARDDOOM2_CMD_WRITE_IDX);
+    hd2->read_idx = 0;
+    hd2->reserve_idx = 0;
+    hd2->write_idx = 0;
+    hd2->published_cnt = hd2->batch_cnt;
+    hd2->sampled_cnt = hd2->batch_cnt;
 
     iowrite32(HARDDOOM2_INTR_MASK, hd2->bar + HARDDOOM2_INTR);
-    iowrite32(HARDDOOM2_INTR_MASK & ~HARDDOOM2_INTR_PONG_ASYNC, hd2->bar + HARDDOOM2_INTR_ENABLE);
+    hd2->intr_enable = HARDDOOM2_INTR_MASK & ~HARDDOOM2_INTR_PONG_ASYNC;
+    iowrite32(hd2->intr_enable, hd2->bar + HARDDOOM2_INTR_ENABLE);
 
     iowrite32(cnt_lower(hd2->batch_cnt), hd2->bar + HARDDOOM2_FENCE_COUNTER);
     iowrite32(cnt_lower(hd2->batch_cnt), hd2->bar + HARDDOOM2_FENCE_WAIT);
+    hd2->last_fence_wait = hd2->batch_cnt;
 
     iowrite32(HARDDOOM2_ENABLE_ALL, hd2->bar + HARDDOOM2_ENABLE);
 }
@@ -658,6 +2002,9 @@ static void free_buffers(struct harddoom2* hd2) {
 
     release_user_bufs(hd2->curr_bufs);
 
+    /* Nothing will run on the device anymore, don't leave anyone waiting. */
+    signal_all_waiters(hd2);
+
     while (!list_empty(&hd2->changes_queue)) {
         struct buffer_change* change = list_first_entry(&hd2->changes_queue, struct buffer_change, list);
 
@@ -733,13 +2080,20 @@ static int pci_probe(struct pci_dev* pdev, const struct pci_device_id* id) {
 
     mutex_init(&hd2->cmd_buff_lock);
     spin_lock_init(&hd2->fence_cnt_lock);
-    spin_lock_init(&hd2->fence_wait_lock);
+    spin_lock_init(&hd2->timeline_lock);
     spin_lock_init(&hd2->intr_flags_lock);
-    spin_lock_init(&hd2->write_idx_lock);
+    spin_lock_init(&hd2->publish_lock);
 
     init_waitqueue_head(&hd2->write_wq);
-    init_waitqueue_head(&hd2->fence_wq);
+    init_waitqueue_head(&hd2->publish_wq);
+    INIT_LIST_HEAD(&hd2->timeline);
     INIT_LIST_HEAD(&hd2->changes_queue);
+    INIT_LIST_HEAD(&hd2->sched_queue);
+    spin_lock_init(&hd2->flushers_lock);
+    INIT_LIST_HEAD(&hd2->flushers);
+    init_waitqueue_head(&hd2->flush_wq);
+    hd2->coalesce_ns = COALESCE_WINDOW_NS;
+    hd2->direct_max_cmds = 0;
 
     pci_set_drvdata(pdev, hd2);
 
@@ -759,7 +2113,7 @@ static int pci_probe(struct pci_dev* pdev, const struct pci_device_id* id) {
     }
 
     struct device* dev = device_create(&doom_class, &pdev->dev,
-            doom_major + dev_number, 0, CHRDEV_PREFIX "%d", dev_number);
+            doom_major + dev_number, hd2, CHRDEV_PREFIX "%d", dev_number);
     if (IS_ERR(dev)) {
         DEBUG("can't create device");
         err = PTR_ERR(dev);
@@ -818,7 +2172,7 @@ static int pci_suspend(struct pci_dev* pdev, pm_message_t state) {
     DEBUG("suspend");
     struct harddoom2* hd2 = pci_get_drvdata(pdev);
 
-    wait_for_fence_cnt(hd2, hd2->batch_cnt);
+    wait_for_fence_cnt(hd2, hd2->batch_cnt, 0);
     device_off(hd2->bar);
 
     return 0;
@@ -830,11 +2184,12 @@ static int pci_resume(struct pci_dev* pdev) {
 
     reset_device(hd2);
 
-    struct cmd dev_cmd = make_setup(hd2->curr_bufs, HARDDOOM2_CMD_FLAG_FENCE);
+    struct cmd dev_cmd = make_setup(hd2->curr_bufs, ALL_BUFS_MASK, HARDDOOM2_CMD_FLAG_FENCE);
     write_cmd(hd2, &dev_cmd, 0);
 
-    iowrite32(1, hd2->bar + HARDDOOM2_CMD_WRITE_IDX);
-    ++hd2->batch_cnt;
+    hd2->reserve_idx = 1;
+    set_write_idx(hd2, 1);
+    hd2->published_cnt = ++hd2->batch_cnt;
 
     return 0;
 }
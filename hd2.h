@@ -1,14 +1,19 @@
 #ifndef HD2_H
 #define HD2_H
 
+#include <linux/list.h>
+
 #include "doomdev2.h"
 
 #include "counter.h"
 #include "hd2_buffer.h"
+#include "validate.h"
 
 struct harddoom2;
 struct hd2_buffer;
 struct dma_buffer;
+struct file;
+struct poll_table_struct;
 
 struct harddoom2* get_hd2(unsigned num);
 
@@ -18,12 +23,151 @@ int harddoom2_create_surface(struct harddoom2* hd2, struct doomdev2_ioctl_create
 
 int harddoom2_create_buffer(struct harddoom2* hd2, struct doomdev2_ioctl_create_buffer __user* _params);
 
-/* Send as many commands in array 'cmds' with size 'num_cmds' as possible to the device using buffers 'bufs'.
-   It is assumed that the given commands are valid with respect to the given buffers.
-   Returns the number of commands written or negative error code. */
+/* Commands to be sent by harddoom2_write, in user or in kernel memory or at the start of an iterator
+   (exactly one of the pointers is set, the iterator isn't advanced). Kernel memory may still be shared
+   with the user, like the submission ring. */
+struct cmd_source {
+    const struct doomdev2_cmd __user* user_cmds;
+    const struct doomdev2_cmd* kern_cmds;
+    const struct iov_iter* iter;
+    size_t num_cmds;
+    /* The commands may be reordered within a window, see DOOMDEV2_SUBMIT_BATCH_RELAXED,
+       and the ones overwritten later in the window dropped, see DOOMDEV2_SUBMIT_BATCH_CULL. */
+    bool relaxed;
+    bool cull;
+};
+
+/* Number of unfinished batches a cost_tracker tells apart; later ones are merged with the last one. */
+#define COST_MARKS 64
+
+/* Estimated device time (see cmds_within_cost) of the batches a submitter has in flight. */
+struct cost_tracker {
+    /* Total cost of the submitted batches and of those known to have finished. */
+    uint64_t submitted;
+    uint64_t completed;
+
+    /* Oldest unfinished batches, as the value of 'submitted' right after batch 'fence'. */
+    struct {
+        counter fence;
+        uint64_t submitted;
+    } marks[COST_MARKS];
+    unsigned first_mark;
+    unsigned num_marks;
+};
+
+/* A submitter competing for the device's command buffer (a context). */
+struct sched_entity {
+    /* DOOMDEV2_PRIORITY_* and weight, see DOOMDEV2_IOCTL_SET_SCHED. */
+    uint32_t priority;
+    uint32_t weight;
+
+    /* Commands sent so far, scaled by the weight. Used by the device to share it fairly. */
+    uint64_t vtime;
+
+    /* Batches sent and not known to have finished yet. */
+    struct cost_tracker cost;
+
+    /* While queued: the buffers it wants to send with and when it was queued. */
+    struct hd2_buffer** bufs;
+    uint64_t enqueue_ns;
+    struct list_head list;
+};
+
+void init_sched_entity(struct sched_entity* se);
+
+/* Longest batch harddoom2_write sends at once. */
+#define MAX_WRITE_CMDS 1024
+
+/* Send as many commands from 'src' as possible (at most MAX_WRITE_CMDS) to the device using buffers 'bufs',
+   described by 'limits'. The commands are copied once to 'staging' (room for MAX_WRITE_CMDS commands,
+   owned by the caller) and validated, then encoded straight into the command buffer;
+   sending stops before the first invalid command. Concurrent callers encode their batches in parallel;
+   the batches reach the device in the order of their fences (small ones may bypass the command buffer
+   when the device has nothing left to fetch). When the device is busy, waiting callers
+   are let in by the priority and fair share of their 'se', preferring, for a short while,
+   those that don't need to change the buffers installed on the device. The estimated device time
+   of a batch, of the batches of 'se' in flight and of all the batches in flight is limited, so sending
+   may stop early or wait for earlier batches to finish.
+   If 'nonblock' is set and there is no space in the command buffer, returns -EAGAIN instead of waiting.
+   Returns the number of commands written or negative error code (-EINVAL if the first command is invalid).
+   On success, the fence that will be passed when the written commands finish is stored in 'fence'. */
 ssize_t harddoom2_write(struct harddoom2* hd2, struct hd2_buffer* bufs[NUM_USER_BUFS],
-        const struct doomdev2_cmd* cmds, size_t num_cmds);
+        const struct bind_limits* limits, const struct cmd_source* src, struct doomdev2_cmd* staging,
+        struct sched_entity* se, bool nonblock, counter* fence);
+
+/* A command list validated and encoded once, which can be sent many times. */
+struct cmd_list;
+
+/* Longest command list harddoom2_record_list accepts. */
+#define MAX_LIST_CMDS 65536
+
+/* Validate all the commands in 'src' against 'limits' and encode them into a new list.
+   Long lists are split between several CPUs.
+   If 'partial' is set, records the valid prefix of 'src' instead of failing if there's an invalid command
+   or one that can't be read.
+   Returns the list or ERR_PTR (-EINVAL if the first, or with 'partial' unset any, command is invalid). */
+struct cmd_list* harddoom2_record_list(const struct bind_limits* limits, const struct cmd_source* src, bool partial);
+
+void harddoom2_free_list(struct cmd_list* list);
+
+size_t list_length(const struct cmd_list* list);
+
+/* Like harddoom2_write, but sends the commands of 'list' starting at 'pos', copying them as they are.
+   'limits' have to be the same as when the list was recorded, otherwise returns -EINVAL. */
+ssize_t harddoom2_write_list(struct harddoom2* hd2, struct hd2_buffer* bufs[NUM_USER_BUFS],
+        const struct bind_limits* limits, const struct cmd_list* list, size_t pos,
+        struct sched_entity* se, bool nonblock, counter* fence);
+
+/* Something holding back commands for the device, like a context coalescing writes. */
+struct pending_flusher {
+    /* Starts sending the held back commands without waiting for them, and returns whether there are any.
+       Called with a spinlock held. Once they're all sent, harddoom2_flush_done must be called. */
+    bool (*flush)(struct pending_flusher*);
+    struct list_head list;
+};
+
+void init_pending_flusher(struct pending_flusher* f, bool (*flush)(struct pending_flusher*));
+
+/* (Un)register 'f' to be flushed by harddoom2_flush_pending. Adding is idempotent. */
+void harddoom2_add_flusher(struct harddoom2* hd2, struct pending_flusher* f);
+void harddoom2_remove_flusher(struct harddoom2* hd2, struct pending_flusher* f);
+
+/* Start sending everything held back, before waiting for the device to finish with a buffer.
+   Doesn't block. Returns whether anything is still held back. */
+bool harddoom2_flush_pending(struct harddoom2* hd2);
+
+/* Like harddoom2_flush_pending, but waits until nothing is held back. */
+void harddoom2_wait_flushed(struct harddoom2* hd2);
+
+/* Like harddoom2_flush_pending, for poll: the poller is woken up once nothing is held back. */
+bool harddoom2_poll_flushed(struct harddoom2* hd2, struct file* file, struct poll_table_struct* wait);
+
+/* Called by flushers once everything they held back has been sent. */
+void harddoom2_flush_done(struct harddoom2* hd2);
+
+/* Wait until the device passes fence 'cnt'. Before sleeping, busy-poll the device for
+   up to 'spin_ns' nanoseconds (or an adaptive budget if it's DOOMDEV2_SPIN_ADAPTIVE). */
+void wait_for_fence_cnt(struct harddoom2* hd2, counter cnt, uint32_t spin_ns);
+
+bool fence_cnt_passed(struct harddoom2* hd2, counter cnt);
+
+/* An entry on the device's timeline of fence waiters. */
+struct fence_waiter {
+    counter cnt;
+    /* Called once the device passes 'cnt', possibly in interrupt context with a spinlock held. */
+    void (*signal)(struct fence_waiter*);
+    struct list_head list;
+};
+
+void init_fence_waiter(struct fence_waiter* w, void (*signal)(struct fence_waiter*));
+
+/* (Re)queue 'w' to be signalled once the device passes 'cnt'. Signals it immediately if it already has. */
+void arm_fence_waiter(struct harddoom2* hd2, struct fence_waiter* w, counter cnt);
+
+/* Dequeue 'w' if it's queued. After this returns 'w' won't be signalled. */
+void cancel_fence_waiter(struct harddoom2* hd2, struct fence_waiter* w);
 
-void wait_for_fence_cnt(struct harddoom2* hd2, counter cnt);
+/* Signal the eventfd 'fd' once the device passes fence 'cnt'. */
+int harddoom2_fence_eventfd(struct harddoom2* hd2, counter cnt, int fd);
 
 #endif
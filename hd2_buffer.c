@@ -3,11 +3,14 @@
 #include <linux/file.h>
 #include <linux/slab.h>
 #include <linux/kref.h>
+#include <linux/poll.h>
 #include <linux/anon_inodes.h>
+#include <linux/uaccess.h>
 
 #include "common.h"
 #include "dma_buffer.h"
 #include "hd2.h"
+#include "region.h"
 
 #include "hd2_buffer.h"
 
@@ -18,19 +21,33 @@ struct hd2_buffer {
 
     /* Used to manage the lifetime of this buffer. May be held by:
        1. the opened file associated with this buffer (once),
-       2. a context (once),
+       2. a context (once as a set buffer and once per handle),
        3. the device (multiple times). */
     struct kref kref;
 
+    /* Wakes up pollers of the buffer's file. */
+    wait_queue_head_t poll_wq;
+    struct fence_waiter poll_waiter;
+
     /* When was the buffer last written to/read from by the device? */
     spinlock_t last_use_lock;
     counter last_use;
 
     spinlock_t last_write_lock;
     counter last_write;
-
-    /* Did the last write to this buffer by the device happen before the last interlock? */
-    bool interlocked;
+    /* Last batch with an INTERLOCK before reading this buffer, which covers the writes of all earlier batches.
+       Batches are encoded concurrently, so this may lag behind. That only costs an extra interlock.
+       Protected by last_write_lock. */
+    counter last_interlock;
+    /* Writes of encoded batches which no INTERLOCK covers yet, the last of those batches, and the number
+       of batches writing the buffer which are still being encoded (whose writes aren't known yet).
+       Protected by last_write_lock. */
+    struct region dirty;
+    counter dirty_fence;
+    unsigned encoding_writes;
+
+    /* Busy-poll budget for waits on this buffer, see DOOMDEV2_BUFFER_IOCTL_SET_SPIN. */
+    uint32_t spin_ns;
 
     /* Non-zero values indicate that this is a surface buffer.
        Zero indicates any other type of buffer (cmd, texture, etc.). */
@@ -41,6 +58,7 @@ struct hd2_buffer {
 static void do_hd2_buff_release(struct kref* kref) {
     DEBUG("do_hd2_buff_release");
     struct hd2_buffer* buff = container_of(kref, struct hd2_buffer, kref);
+    cancel_fence_waiter(buff->hd2, &buff->poll_waiter);
     free_dma_buff(&buff->dma_buff);
     kfree(buff);
 }
@@ -73,9 +91,21 @@ static ssize_t hd2_buff_write(struct file* file, const char __user* _buff, size_
         return -EINVAL;
     }
 
+    /* Commands held back by a context may use the buffer too. They're sent by the context's work. */
+    if (file->f_flags & O_NONBLOCK) {
+        if (harddoom2_flush_pending(buff->hd2)) {
+            return -EAGAIN;
+        }
+    } else {
+        harddoom2_wait_flushed(buff->hd2);
+    }
     counter last_use = get_last_use(buff);
 
-    wait_for_fence_cnt(buff->hd2, last_use);
+    if (file->f_flags & O_NONBLOCK && !fence_cnt_passed(buff->hd2, last_use)) {
+        return -EAGAIN;
+    }
+
+    wait_for_fence_cnt(buff->hd2, last_use, READ_ONCE(buff->spin_ns));
     /* Someone might have moved buff->last_use forward by now, but we don't care.
        If the user doesn't want to see any artifacts, it's their responsibility not to send
        any commands using this buffer in parallel with a buffer_write or buffer_read call. */
@@ -110,9 +140,21 @@ static ssize_t hd2_buff_read(struct file* file, char __user *_buff, size_t count
         return -EINVAL;
     }
 
+    /* See comment in buffer_write. */
+    if (file->f_flags & O_NONBLOCK) {
+        if (harddoom2_flush_pending(buff->hd2)) {
+            return -EAGAIN;
+        }
+    } else {
+        harddoom2_wait_flushed(buff->hd2);
+    }
     counter last_write = get_last_write(buff);
 
-    wait_for_fence_cnt(buff->hd2, last_write);
+    if (file->f_flags & O_NONBLOCK && !fence_cnt_passed(buff->hd2, last_write)) {
+        return -EAGAIN;
+    }
+
+    wait_for_fence_cnt(buff->hd2, last_write, READ_ONCE(buff->spin_ns));
     /* See comment in buffer_write. */
 
     ssize_t ret = read_dma_buff_user(&buff->dma_buff, _buff, *off, count);
@@ -126,6 +168,38 @@ static ssize_t hd2_buff_read(struct file* file, char __user *_buff, size_t count
     return ret;
 }
 
+static void signal_poll_waiter(struct fence_waiter* w) {
+    wake_up_all(&container_of(w, struct hd2_buffer, poll_waiter)->poll_wq);
+}
+
+/* The buffer is readable once the device has finished writing to it
+   and writable once the device has finished using it. */
+static __poll_t hd2_buff_poll(struct file* file, poll_table* wait) {
+    struct hd2_buffer* buff = file->private_data;
+
+    poll_wait(file, &buff->poll_wq, wait);
+
+    /* Held back commands may use the buffer, we're woken up once they're sent. */
+    if (harddoom2_poll_flushed(buff->hd2, file, wait)) {
+        return 0;
+    }
+
+    /* The last write always happens no later than the last use. */
+    counter last_write = get_last_write(buff);
+    if (!fence_cnt_passed(buff->hd2, last_write)) {
+        arm_fence_waiter(buff->hd2, &buff->poll_waiter, last_write);
+        return 0;
+    }
+
+    counter last_use = get_last_use(buff);
+    if (!fence_cnt_passed(buff->hd2, last_use)) {
+        arm_fence_waiter(buff->hd2, &buff->poll_waiter, last_use);
+        return EPOLLIN | EPOLLRDNORM;
+    }
+
+    return EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM;
+}
+
 static loff_t hd2_buff_llseek(struct file* file, loff_t off, int whence) {
     struct hd2_buffer* buff = file->private_data;
     BUG_ON(file->f_pos < 0 || file->f_pos > buff->dma_buff.size);
@@ -148,11 +222,36 @@ static loff_t hd2_buff_llseek(struct file* file, loff_t off, int whence) {
     return off;
 }
 
+static long hd2_buff_ioctl(struct file* file, unsigned cmd, unsigned long arg) {
+    struct hd2_buffer* buff = file->private_data;
+
+    switch (cmd) {
+    case DOOMDEV2_BUFFER_IOCTL_SET_SPIN: {
+        struct doomdev2_buffer_ioctl_set_spin params;
+        if (copy_from_user(&params, (void __user*)arg, sizeof(struct doomdev2_buffer_ioctl_set_spin))) {
+            DEBUG("set_spin copy_from_user fail");
+            return -EFAULT;
+        }
+        if (params._pad) {
+            DEBUG("set_spin: nonzero padding");
+            return -EINVAL;
+        }
+        WRITE_ONCE(buff->spin_ns, params.spin_ns);
+        return 0;
+    }
+    }
+
+    return -ENOTTY;
+}
+
 static const struct file_operations hd2_buff_ops = {
     .owner = THIS_MODULE,
     .release = hd2_buff_release,
     .write = hd2_buff_write,
     .read = hd2_buff_read,
+    .poll = hd2_buff_poll,
+    .unlocked_ioctl = hd2_buff_ioctl,
+    .compat_ioctl = hd2_buff_ioctl,
     .llseek = hd2_buff_llseek
 };
 
@@ -174,13 +273,16 @@ int new_hd2_buffer(struct harddoom2* hd2, size_t size, uint16_t width, uint16_t
     buff->hd2 = hd2;
     buff->width = width;
     buff->height = height;
-    buff->interlocked = true;
+    buff->spin_ns = DOOMDEV2_SPIN_ADAPTIVE;
 
     kref_init(&buff->kref);
 
     spin_lock_init(&buff->last_use_lock);
     spin_lock_init(&buff->last_write_lock);
 
+    init_waitqueue_head(&buff->poll_wq);
+    init_fence_waiter(&buff->poll_waiter, signal_poll_waiter);
+
     int flags = O_RDWR | O_CLOEXEC;
 
     int fd = get_unused_fd_flags(flags);
@@ -258,20 +360,47 @@ counter get_last_write(struct hd2_buffer* buff) {
     return res;
 }
 
-void set_last_write(struct hd2_buffer* buff, counter cnt) {
+void begin_write(struct hd2_buffer* buff, counter cnt) {
     spin_lock(&buff->last_write_lock);
     BUG_ON(cnt < buff->last_write);
     buff->last_write = cnt;
+    ++buff->encoding_writes;
     spin_unlock(&buff->last_write_lock);
-    buff->interlocked = false;
 }
 
-bool interlocked(const struct hd2_buffer* buff) {
-    return buff->interlocked;
+void end_write(struct hd2_buffer* buff, counter cnt, const struct region* written) {
+    spin_lock(&buff->last_write_lock);
+    BUG_ON(!buff->encoding_writes);
+    --buff->encoding_writes;
+    /* A later INTERLOCK already covers the whole batch. */
+    if (cnt >= buff->last_interlock && !region_empty(written)) {
+        region_add_region(&buff->dirty, written);
+        buff->dirty_fence = max(buff->dirty_fence, cnt);
+    }
+    spin_unlock(&buff->last_write_lock);
 }
 
-void interlock(struct hd2_buffer* buff) {
-    buff->interlocked = true;
+void get_dirty_region(struct hd2_buffer* buff, struct region* dirty) {
+    spin_lock(&buff->last_write_lock);
+    if (buff->encoding_writes) {
+        region_init(dirty);
+        region_add(dirty, &(struct rect){ .x1 = buff->width, .y1 = buff->height });
+    } else {
+        *dirty = buff->dirty;
+    }
+    spin_unlock(&buff->last_write_lock);
+}
+
+void interlock(struct hd2_buffer* buff, counter cnt) {
+    spin_lock(&buff->last_write_lock);
+    if (cnt > buff->last_interlock) {
+        buff->last_interlock = cnt;
+    }
+    /* Writes of later batches may already be in, then the region is kept whole. */
+    if (buff->dirty_fence < cnt) {
+        region_init(&buff->dirty);
+    }
+    spin_unlock(&buff->last_write_lock);
 }
 
 bool assigned_to(const struct hd2_buffer* buff, const struct harddoom2* hd2) {
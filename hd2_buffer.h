@@ -15,6 +15,7 @@
 
 struct harddoom2;
 struct hd2_buffer;
+struct region;
 
 /* Open a new file representing a buffer and return its file descriptor. */
 int new_hd2_buffer(struct harddoom2* hd2, size_t size, uint16_t width, uint16_t height);
@@ -31,10 +32,15 @@ counter get_last_use(struct hd2_buffer*);
 void set_last_use(struct hd2_buffer*, counter cnt);
 
 counter get_last_write(struct hd2_buffer*);
-void set_last_write(struct hd2_buffer*, counter cnt);
-
-bool interlocked(const struct hd2_buffer*);
-void interlock(struct hd2_buffer*);
+/* Record that batch 'cnt' writes the surface. Once it's encoded, end_write gives the pixels it wrote
+   (those after its INTERLOCK, if it has one). Until then, the whole surface counts as dirty. */
+void begin_write(struct hd2_buffer*, counter cnt);
+void end_write(struct hd2_buffer*, counter cnt, const struct region* written);
+
+/* The device's writes to the surface which no INTERLOCK covers yet. */
+void get_dirty_region(struct hd2_buffer*, struct region* dirty);
+/* Record that an INTERLOCK before a read of the buffer was sent in batch 'cnt'. */
+void interlock(struct hd2_buffer*, counter cnt);
 
 bool assigned_to(const struct hd2_buffer*, const struct harddoom2*);
 
@@ -0,0 +1,118 @@
+#include <linux/kernel.h>
+
+#include "doomdev2.h"
+
+#include "common.h"
+
+#include "region.h"
+
+/* Do the rectangles overlap or touch? Touching ones, like neighbouring columns, are merged. */
+static bool rects_meet(const struct rect* a, const struct rect* b) {
+    return a->x0 <= b->x1 && b->x0 <= a->x1 && a->y0 <= b->y1 && b->y0 <= a->y1;
+}
+
+static void rect_union(struct rect* a, const struct rect* b) {
+    a->x0 = min(a->x0, b->x0);
+    a->y0 = min(a->y0, b->y0);
+    a->x1 = max(a->x1, b->x1);
+    a->y1 = max(a->y1, b->y1);
+}
+
+static uint32_t rect_area(const struct rect* rect) {
+    return (uint32_t)(rect->x1 - rect->x0) * (rect->y1 - rect->y0);
+}
+
+void region_add(struct region* region, const struct rect* rect) {
+    for (unsigned i = 0; i < region->num_rects; ++i) {
+        if (rects_meet(&region->rects[i], rect)) {
+            rect_union(&region->rects[i], rect);
+            return;
+        }
+    }
+
+    if (region->num_rects < REGION_RECTS) {
+        region->rects[region->num_rects++] = *rect;
+        return;
+    }
+
+    /* Out of rectangles: grow the one which grows the least. */
+    unsigned best = 0;
+    uint32_t best_growth = U32_MAX;
+    for (unsigned i = 0; i < REGION_RECTS; ++i) {
+        struct rect merged = region->rects[i];
+        rect_union(&merged, rect);
+        uint32_t growth = rect_area(&merged) - rect_area(&region->rects[i]);
+        if (growth < best_growth) {
+            best = i;
+            best_growth = growth;
+        }
+    }
+    rect_union(&region->rects[best], rect);
+}
+
+void region_add_region(struct region* region, const struct region* other) {
+    for (unsigned i = 0; i < other->num_rects; ++i) {
+        region_add(region, &other->rects[i]);
+    }
+}
+
+bool region_intersects(const struct region* region, const struct rect* rect) {
+    for (unsigned i = 0; i < region->num_rects; ++i) {
+        if (rects_intersect(&region->rects[i], rect)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void set_rect(struct rect* rect, uint16_t x, uint16_t y, uint16_t width, uint16_t height) {
+    *rect = (struct rect){ .x0 = x, .y0 = y, .x1 = x + width, .y1 = y + height };
+}
+
+void cmd_dst_rect(const struct doomdev2_cmd* cmd, struct rect* rect) {
+    switch (cmd->type) {
+    case DOOMDEV2_CMD_TYPE_COPY_RECT:
+        set_rect(rect, cmd->copy_rect.pos_dst_x, cmd->copy_rect.pos_dst_y,
+                cmd->copy_rect.width, cmd->copy_rect.height);
+        break;
+    case DOOMDEV2_CMD_TYPE_FILL_RECT:
+        set_rect(rect, cmd->fill_rect.pos_x, cmd->fill_rect.pos_y, cmd->fill_rect.width, cmd->fill_rect.height);
+        break;
+    case DOOMDEV2_CMD_TYPE_DRAW_LINE: {
+        const struct doomdev2_cmd_draw_line* line = &cmd->draw_line;
+        *rect = (struct rect){
+            .x0 = min(line->pos_a_x, line->pos_b_x), .y0 = min(line->pos_a_y, line->pos_b_y),
+            .x1 = max(line->pos_a_x, line->pos_b_x) + 1, .y1 = max(line->pos_a_y, line->pos_b_y) + 1,
+        };
+        break;
+    }
+    case DOOMDEV2_CMD_TYPE_DRAW_BACKGROUND:
+        set_rect(rect, cmd->draw_background.pos_x, cmd->draw_background.pos_y,
+                cmd->draw_background.width, cmd->draw_background.height);
+        break;
+    case DOOMDEV2_CMD_TYPE_DRAW_COLUMN:
+        *rect = (struct rect){
+            .x0 = cmd->draw_column.pos_x, .y0 = cmd->draw_column.pos_a_y,
+            .x1 = cmd->draw_column.pos_x + 1, .y1 = cmd->draw_column.pos_b_y + 1,
+        };
+        break;
+    case DOOMDEV2_CMD_TYPE_DRAW_SPAN:
+        *rect = (struct rect){
+            .x0 = cmd->draw_span.pos_a_x, .y0 = cmd->draw_span.pos_y,
+            .x1 = cmd->draw_span.pos_b_x + 1, .y1 = cmd->draw_span.pos_y + 1,
+        };
+        break;
+    case DOOMDEV2_CMD_TYPE_DRAW_FUZZ:
+        *rect = (struct rect){
+            .x0 = cmd->draw_fuzz.pos_x, .y0 = cmd->draw_fuzz.pos_a_y,
+            .x1 = cmd->draw_fuzz.pos_x + 1, .y1 = cmd->draw_fuzz.pos_b_y + 1,
+        };
+        break;
+    default:
+        BUG();
+    }
+}
+
+void copy_src_rect(const struct doomdev2_cmd* cmd, struct rect* rect) {
+    set_rect(rect, cmd->copy_rect.pos_src_x, cmd->copy_rect.pos_src_y, cmd->copy_rect.width, cmd->copy_rect.height);
+}
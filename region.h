@@ -0,0 +1,45 @@
+#ifndef REGION_H
+#define REGION_H
+
+#include <linux/types.h>
+
+#include "doomdev2.h"
+
+#define REGION_RECTS 4
+
+/* Pixels [x0, x1) x [y0, y1) of a surface. */
+struct rect {
+    uint16_t x0;
+    uint16_t y0;
+    uint16_t x1;
+    uint16_t y1;
+};
+
+/* A set of pixels, covered by up to REGION_RECTS rectangles. It may cover more pixels than were added. */
+struct region {
+    unsigned num_rects;
+    struct rect rects[REGION_RECTS];
+};
+
+static inline void region_init(struct region* region) {
+    region->num_rects = 0;
+}
+
+static inline bool region_empty(const struct region* region) {
+    return !region->num_rects;
+}
+
+static inline bool rects_intersect(const struct rect* a, const struct rect* b) {
+    return a->x0 < b->x1 && b->x0 < a->x1 && a->y0 < b->y1 && b->y0 < a->y1;
+}
+
+void region_add(struct region* region, const struct rect* rect);
+void region_add_region(struct region* region, const struct region* other);
+bool region_intersects(const struct region* region, const struct rect* rect);
+
+/* The pixels a valid command may write. */
+void cmd_dst_rect(const struct doomdev2_cmd* cmd, struct rect* rect);
+/* The pixels a valid COPY_RECT reads. */
+void copy_src_rect(const struct doomdev2_cmd* cmd, struct rect* rect);
+
+#endif
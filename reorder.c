@@ -0,0 +1,119 @@
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+
+#include "doomdev2.h"
+
+#include "common.h"
+#include "region.h"
+
+#include "reorder.h"
+
+/* Only runs of these move, anything else stays where it was and nothing moves past it. */
+static bool batchable(const struct doomdev2_cmd* cmd) {
+    return cmd->type == DOOMDEV2_CMD_TYPE_DRAW_COLUMN || cmd->type == DOOMDEV2_CMD_TYPE_DRAW_FUZZ;
+}
+
+/* Would the FE keep the commands in one batch? It ends a batch on a different command type,
+   colormap, texture dimensions or fuzz area. */
+static bool same_batch(const struct doomdev2_cmd* a, const struct doomdev2_cmd* b) {
+    if (a->type != b->type) {
+        return false;
+    }
+
+    if (a->type == DOOMDEV2_CMD_TYPE_DRAW_FUZZ) {
+        return a->draw_fuzz.fuzz_start == b->draw_fuzz.fuzz_start && a->draw_fuzz.fuzz_end == b->draw_fuzz.fuzz_end
+            && a->draw_fuzz.colormap_idx == b->draw_fuzz.colormap_idx;
+    }
+
+    const struct doomdev2_cmd_draw_column* col_a = &a->draw_column;
+    const struct doomdev2_cmd_draw_column* col_b = &b->draw_column;
+    return col_a->flags == col_b->flags && col_a->texture_height == col_b->texture_height
+        && (!(col_a->flags & DOOMDEV2_CMD_FLAGS_COLORMAP) || col_a->colormap_idx == col_b->colormap_idx)
+        && (!(col_a->flags & DOOMDEV2_CMD_FLAGS_TRANSLATE) || col_a->translation_idx == col_b->translation_idx);
+}
+
+/* The pixels a command reads or writes. Columns blended with the tranmap read only what they write,
+   fuzz reads its whole area. */
+static void touched_rect(const struct doomdev2_cmd* cmd, struct rect* rect) {
+    if (cmd->type == DOOMDEV2_CMD_TYPE_DRAW_FUZZ) {
+        *rect = (struct rect){
+            .x0 = cmd->draw_fuzz.pos_x, .y0 = cmd->draw_fuzz.fuzz_start,
+            .x1 = cmd->draw_fuzz.pos_x + 1, .y1 = cmd->draw_fuzz.fuzz_end + 1,
+        };
+    } else {
+        cmd_dst_rect(cmd, rect);
+    }
+}
+
+/* Put 'cmds[order[i]]' at 'cmds[i]', following the cycles of the permutation. */
+static void permute_cmds(struct doomdev2_cmd* cmds, const uint8_t* order, size_t num_cmds) {
+    uint32_t placed = 0;
+
+    for (size_t start = 0; start < num_cmds; ++start) {
+        if (placed & BIT(start)) {
+            continue;
+        }
+
+        struct doomdev2_cmd first = cmds[start];
+        size_t pos = start;
+        while (order[pos] != start) {
+            cmds[pos] = cmds[order[pos]];
+            placed |= BIT(pos);
+            pos = order[pos];
+        }
+        cmds[pos] = first;
+        placed |= BIT(pos);
+    }
+}
+
+void reorder_cmds(struct doomdev2_cmd* cmds, size_t num_cmds) {
+    struct rect rects[REORDER_WINDOW];
+    uint8_t order[REORDER_WINDOW];
+    uint32_t done = 0;
+    size_t num_ordered = 0;
+    bool moved = false;
+
+    BUG_ON(num_cmds > REORDER_WINDOW);
+
+    for (size_t it = 0; it < num_cmds; ++it) {
+        if (batchable(&cmds[it])) {
+            touched_rect(&cmds[it], &rects[it]);
+        }
+    }
+
+    for (size_t first = 0; first < num_cmds; ++first) {
+        if (done & BIT(first)) {
+            continue;
+        }
+        order[num_ordered++] = first;
+        done |= BIT(first);
+
+        if (!batchable(&cmds[first])) {
+            continue;
+        }
+
+        /* Pull up the following commands of the same batch, unless a command they'd jump over
+           touches the same pixels. */
+        for (size_t next = first + 1; next < num_cmds && batchable(&cmds[next]); ++next) {
+            if ((done & BIT(next)) || !same_batch(&cmds[first], &cmds[next])) {
+                continue;
+            }
+
+            bool blocked = false;
+            for (size_t it = first + 1; it < next && !blocked; ++it) {
+                blocked = !(done & BIT(it)) && rects_intersect(&rects[it], &rects[next]);
+            }
+            if (blocked) {
+                continue;
+            }
+
+            moved |= num_ordered != next;
+            order[num_ordered++] = next;
+            done |= BIT(next);
+        }
+    }
+
+    if (moved) {
+        permute_cmds(cmds, order, num_cmds);
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef REORDER_H
+#define REORDER_H
+
+#include <linux/types.h>
+
+#include "doomdev2.h"
+
+/* Most commands reorder_cmds looks at together. */
+#define REORDER_WINDOW 32
+
+/* Move DRAW_COLUMN and DRAW_FUZZ commands which the FE can batch together next to each other,
+   without changing the result (see DOOMDEV2_SUBMIT_BATCH_RELAXED). The commands have to be valid. */
+void reorder_cmds(struct doomdev2_cmd* cmds, size_t num_cmds);
+
+#endif
@@ -0,0 +1,126 @@
+/* A write() long enough to be recorded as a list (at least 16384 commands) that fills rectangles
+   and copies them within the same surface, some right after the fill and some thousands of commands
+   later, so that the copies cross the batches and the parts the list is split into.
+   Every copy has to see the color it was filled with. Needs the device (-d, /dev/doom0 by default). */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "../doomdev2.h"
+
+#define SURF_SIZE 256
+#define NUM_CMDS 20000
+/* Rectangles filled in the top half and copied to the bottom half. */
+#define BLOCK 8
+#define NUM_BLOCKS (SURF_SIZE / BLOCK)
+/* Every other block is copied this many commands after it's filled, the rest right after. */
+#define FAR_COPY 5000
+
+static void fill(struct doomdev2_cmd* cmd, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t color) {
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->fill_rect.type = DOOMDEV2_CMD_TYPE_FILL_RECT;
+    cmd->fill_rect.fill_color = color;
+    cmd->fill_rect.pos_x = x;
+    cmd->fill_rect.pos_y = y;
+    cmd->fill_rect.width = w;
+    cmd->fill_rect.height = h;
+}
+
+static void copy(struct doomdev2_cmd* cmd, uint16_t src_x, uint16_t src_y, uint16_t dst_x, uint16_t dst_y) {
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->copy_rect.type = DOOMDEV2_CMD_TYPE_COPY_RECT;
+    cmd->copy_rect.pos_src_x = src_x;
+    cmd->copy_rect.pos_src_y = src_y;
+    cmd->copy_rect.pos_dst_x = dst_x;
+    cmd->copy_rect.pos_dst_y = dst_y;
+    cmd->copy_rect.width = BLOCK;
+    cmd->copy_rect.height = BLOCK;
+}
+
+int main(int argc, char** argv) {
+    const char* dev_path = argc > 2 && !strcmp(argv[1], "-d") ? argv[2] : "/dev/doom0";
+
+    int ctx = open(dev_path, O_RDWR);
+    if (ctx < 0) {
+        perror(dev_path);
+        return 1;
+    }
+    struct doomdev2_ioctl_create_surface surface = { .width = SURF_SIZE, .height = SURF_SIZE };
+    int surf = ioctl(ctx, DOOMDEV2_IOCTL_CREATE_SURFACE, &surface);
+    if (surf < 0) {
+        perror("create surface");
+        return 1;
+    }
+    struct doomdev2_ioctl_setup setup = {
+        .surf_dst_fd = surf,
+        .surf_src_fd = surf,
+        .texture_fd = -1,
+        .flat_fd = -1,
+        .colormap_fd = -1,
+        .translation_fd = -1,
+        .tranmap_fd = -1,
+    };
+    if (ioctl(ctx, DOOMDEV2_IOCTL_SETUP, &setup)) {
+        perror("setup");
+        return 1;
+    }
+
+    static struct doomdev2_cmd cmds[NUM_CMDS];
+    /* The filler writes a pixel nothing else looks at. */
+    for (size_t it = 0; it < NUM_CMDS; ++it) {
+        fill(&cmds[it], SURF_SIZE - 1, SURF_SIZE - 1, 1, 1, 0xff);
+    }
+    fill(&cmds[0], 0, 0, SURF_SIZE, SURF_SIZE, 0);
+    for (unsigned b = 0; b < NUM_BLOCKS; ++b) {
+        size_t pos = 1 + b * ((NUM_CMDS - FAR_COPY - 2) / NUM_BLOCKS);
+        uint16_t x = b * BLOCK;
+        fill(&cmds[pos], x, 0, BLOCK, BLOCK, b + 1);
+        copy(&cmds[b % 2 ? pos + FAR_COPY : pos + 1], x, 0, x, SURF_SIZE / 2);
+    }
+
+    size_t sent = 0;
+    while (sent < NUM_CMDS) {
+        ssize_t ret = write(ctx, &cmds[sent], (NUM_CMDS - sent) * sizeof(struct doomdev2_cmd));
+        if (ret <= 0) {
+            fprintf(stderr, "write: %s\n", ret < 0 ? strerror(errno) : "nothing written");
+            return 1;
+        }
+        sent += ret / sizeof(struct doomdev2_cmd);
+    }
+
+    /* Reading the surface waits for the commands writing it. */
+    static uint8_t pixels[SURF_SIZE * SURF_SIZE];
+    if (pread(surf, pixels, sizeof(pixels), 0) != sizeof(pixels)) {
+        perror("read surface");
+        return 1;
+    }
+
+    int failed = 0;
+    for (unsigned b = 0; b < NUM_BLOCKS; ++b) {
+        for (unsigned y = SURF_SIZE / 2; y < SURF_SIZE / 2 + BLOCK; ++y) {
+            for (unsigned x = b * BLOCK; x < (b + 1) * BLOCK; ++x) {
+                if (pixels[y * SURF_SIZE + x] != b + 1) {
+                    fprintf(stderr, "block %u: pixel (%u, %u) is %u, not %u\n", b, x, y,
+                            pixels[y * SURF_SIZE + x], b + 1);
+                    failed = 1;
+                    goto next_block;
+                }
+            }
+        }
+next_block:;
+    }
+
+    close(surf);
+    close(ctx);
+    if (!failed) {
+        printf("large_write_interlock: ok\n");
+    }
+    return failed;
+}
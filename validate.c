@@ -0,0 +1,240 @@
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+
+#include "doomdev2.h"
+
+#include "common.h"
+#include "hd2_buffer.h"
+
+#include "validate.h"
+
+/* Above any uint16_t index. */
+#define NO_BOUND 0x10000
+
+/* Number of commands in a run checked before looking at the results. */
+#define RUN_BLOCK 8
+
+void compute_bind_limits(struct bind_limits* limits, struct hd2_buffer* bufs[NUM_USER_BUFS]) {
+    memset(limits, 0, sizeof(struct bind_limits));
+
+    if (bufs[DST_BUF_IDX]) {
+        limits->surf_width = get_buff_width(bufs[DST_BUF_IDX]);
+        limits->surf_height = get_buff_height(bufs[DST_BUF_IDX]);
+    }
+    if (bufs[SRC_BUF_IDX]) {
+        BUG_ON(bufs[DST_BUF_IDX] && (get_buff_width(bufs[SRC_BUF_IDX]) != limits->surf_width
+                    || get_buff_height(bufs[SRC_BUF_IDX]) != limits->surf_height));
+        limits->has_src = true;
+        limits->src_is_dst = bufs[SRC_BUF_IDX] == bufs[DST_BUF_IDX];
+    }
+    if (bufs[TEXTURE_BUF_IDX]) {
+        limits->has_texture = true;
+        limits->texture_limit = (get_buff_size(bufs[TEXTURE_BUF_IDX]) - 1) >> 6;
+    }
+    if (bufs[FLAT_BUF_IDX]) {
+        limits->flats = get_buff_size(bufs[FLAT_BUF_IDX]) >> 12;
+    }
+
+    uint32_t translations = bufs[TRANSLATE_BUF_IDX] ? get_buff_size(bufs[TRANSLATE_BUF_IDX]) >> 8 : 0;
+    uint32_t colormaps = bufs[COLORMAP_BUF_IDX] ? get_buff_size(bufs[COLORMAP_BUF_IDX]) >> 8 : 0;
+    for (unsigned flags = 0; flags < DRAW_FLAGS_COMBINATIONS; ++flags) {
+        if (flags & DOOMDEV2_CMD_FLAGS_TRANMAP && !bufs[TRANMAP_BUF_IDX]) {
+            /* No index can make this valid. */
+            continue;
+        }
+        limits->translation_bound[flags] = flags & DOOMDEV2_CMD_FLAGS_TRANSLATE ? translations : NO_BOUND;
+        limits->colormap_bound[flags] = flags & DOOMDEV2_CMD_FLAGS_COLORMAP ? colormaps : NO_BOUND;
+    }
+}
+
+/* The checks below return whether a command is invalid. They combine all the comparisons with '|',
+   so that a command costs a few compares and no branches besides the final one. */
+
+static bool copy_rect_bad(const struct bind_limits* limits, const struct doomdev2_cmd* user_cmd) {
+    const struct doomdev2_cmd_copy_rect* cmd = &user_cmd->copy_rect;
+    uint32_t w = limits->surf_width, h = limits->surf_height;
+
+    bool overlap = (cmd->pos_dst_x < cmd->pos_src_x + cmd->width) & (cmd->pos_dst_x + cmd->width > cmd->pos_src_x)
+        & (cmd->pos_dst_y < cmd->pos_src_y + cmd->height) & (cmd->pos_dst_y + cmd->height > cmd->pos_src_y);
+
+    return !limits->has_src
+        | ((uint32_t)cmd->pos_dst_x + cmd->width > w) | ((uint32_t)cmd->pos_dst_y + cmd->height > h)
+        | ((uint32_t)cmd->pos_src_x + cmd->width > w) | ((uint32_t)cmd->pos_src_y + cmd->height > h)
+        | (limits->src_is_dst & overlap);
+}
+
+static bool fill_rect_bad(const struct bind_limits* limits, const struct doomdev2_cmd* user_cmd) {
+    const struct doomdev2_cmd_fill_rect* cmd = &user_cmd->fill_rect;
+    return ((uint32_t)cmd->pos_x + cmd->width > limits->surf_width)
+        | ((uint32_t)cmd->pos_y + cmd->height > limits->surf_height);
+}
+
+static bool draw_line_bad(const struct bind_limits* limits, const struct doomdev2_cmd* user_cmd) {
+    const struct doomdev2_cmd_draw_line* cmd = &user_cmd->draw_line;
+    return (cmd->pos_a_x >= limits->surf_width) | (cmd->pos_a_y >= limits->surf_height)
+        | (cmd->pos_b_x >= limits->surf_width) | (cmd->pos_b_y >= limits->surf_height);
+}
+
+static bool draw_background_bad(const struct bind_limits* limits, const struct doomdev2_cmd* user_cmd) {
+    const struct doomdev2_cmd_draw_background* cmd = &user_cmd->draw_background;
+    return ((uint32_t)cmd->pos_x + cmd->width > limits->surf_width)
+        | ((uint32_t)cmd->pos_y + cmd->height > limits->surf_height)
+        | (cmd->flat_idx >= limits->flats);
+}
+
+static __always_inline bool draw_maps_bad(const struct bind_limits* limits, uint8_t flags,
+        uint16_t colormap_idx, uint16_t translation_idx) {
+    unsigned map_flags = flags & (DRAW_FLAGS_COMBINATIONS - 1);
+    return (translation_idx >= limits->translation_bound[map_flags])
+        | (colormap_idx >= limits->colormap_bound[map_flags]);
+}
+
+static __always_inline bool draw_column_bad(const struct bind_limits* limits, const struct doomdev2_cmd* user_cmd) {
+    const struct doomdev2_cmd_draw_column* cmd = &user_cmd->draw_column;
+    return !limits->has_texture
+        | (cmd->pos_x >= limits->surf_width) | (cmd->pos_b_y >= limits->surf_height)
+        | (cmd->pos_b_y < cmd->pos_a_y)
+        | draw_maps_bad(limits, cmd->flags, cmd->colormap_idx, cmd->translation_idx);
+}
+
+static __always_inline bool draw_span_bad(const struct bind_limits* limits, const struct doomdev2_cmd* user_cmd) {
+    const struct doomdev2_cmd_draw_span* cmd = &user_cmd->draw_span;
+    return (cmd->pos_y >= limits->surf_height) | (cmd->pos_b_x >= limits->surf_width)
+        | (cmd->pos_b_x < cmd->pos_a_x)
+        | (cmd->flat_idx >= limits->flats)
+        | draw_maps_bad(limits, cmd->flags, cmd->colormap_idx, cmd->translation_idx);
+}
+
+static bool draw_fuzz_bad(const struct bind_limits* limits, const struct doomdev2_cmd* user_cmd) {
+    const struct doomdev2_cmd_draw_fuzz* cmd = &user_cmd->draw_fuzz;
+    return (cmd->pos_x >= limits->surf_width) | (cmd->fuzz_end >= limits->surf_height)
+        | (cmd->fuzz_start > cmd->pos_a_y) | (cmd->pos_a_y > cmd->pos_b_y) | (cmd->pos_b_y > cmd->fuzz_end)
+        | (cmd->colormap_idx >= limits->colormap_bound[DOOMDEV2_CMD_FLAGS_COLORMAP])
+        | (cmd->fuzz_pos > 55);
+}
+
+typedef bool (*cmd_check_t)(const struct bind_limits*, const struct doomdev2_cmd*);
+
+static const cmd_check_t cmd_checks[] = {
+    [DOOMDEV2_CMD_TYPE_COPY_RECT] = copy_rect_bad,
+    [DOOMDEV2_CMD_TYPE_FILL_RECT] = fill_rect_bad,
+    [DOOMDEV2_CMD_TYPE_DRAW_LINE] = draw_line_bad,
+    [DOOMDEV2_CMD_TYPE_DRAW_BACKGROUND] = draw_background_bad,
+    [DOOMDEV2_CMD_TYPE_DRAW_COLUMN] = draw_column_bad,
+    [DOOMDEV2_CMD_TYPE_DRAW_SPAN] = draw_span_bad,
+    [DOOMDEV2_CMD_TYPE_DRAW_FUZZ] = draw_fuzz_bad,
+};
+
+/* Columns and spans make up most of a frame. Runs of them are checked in blocks of RUN_BLOCK
+   without dispatching on the type or stopping early inside a block.
+   Returns the length of the valid prefix of the run of 'type' commands at the start of 'cmds'. */
+static __always_inline size_t validate_run(const struct bind_limits* limits, const struct doomdev2_cmd* cmds,
+        size_t num_cmds, uint8_t type, cmd_check_t bad) {
+    size_t run = 1;
+    while (run < num_cmds && cmds[run].type == type) {
+        ++run;
+    }
+
+    size_t it = 0;
+    for (; it + RUN_BLOCK <= run; it += RUN_BLOCK) {
+        unsigned bad_mask = 0;
+        for (unsigned i = 0; i < RUN_BLOCK; ++i) {
+            bad_mask |= (unsigned)bad(limits, &cmds[it + i]) << i;
+        }
+        if (bad_mask) {
+            return it + __ffs(bad_mask);
+        }
+    }
+    for (; it < run; ++it) {
+        if (bad(limits, &cmds[it])) {
+            break;
+        }
+    }
+    return it;
+}
+
+size_t validate_cmds(const struct bind_limits* limits, const struct doomdev2_cmd* cmds, size_t num_cmds) {
+    BUG_ON(!limits->surf_width);
+
+    size_t it = 0;
+    while (it < num_cmds) {
+        uint8_t type = cmds[it].type;
+        size_t valid;
+
+        switch (type) {
+        case DOOMDEV2_CMD_TYPE_DRAW_COLUMN:
+            valid = validate_run(limits, &cmds[it], num_cmds - it, type, draw_column_bad);
+            break;
+        case DOOMDEV2_CMD_TYPE_DRAW_SPAN:
+            valid = validate_run(limits, &cmds[it], num_cmds - it, type, draw_span_bad);
+            break;
+        default:
+            if (type >= ARRAY_SIZE(cmd_checks)) {
+                DEBUG("unknown cmd type: %u", type);
+                return it;
+            }
+            valid = !cmd_checks[type](limits, &cmds[it]);
+            break;
+        }
+
+        /* If a run stopped at an invalid command, the next iteration gets here with it. */
+        if (!valid) {
+            DEBUG("invalid cmd %lu of type %u", it, type);
+            return it;
+        }
+        it += valid;
+    }
+
+    return it;
+}
+
+/* Cost of a command besides the pixels it draws: fetching, decoding, setting up the units. */
+#define CMD_BASE_COST 16
+
+uint32_t cmd_cost(const struct doomdev2_cmd* cmd) {
+    uint32_t pixels;
+
+    switch (cmd->type) {
+    case DOOMDEV2_CMD_TYPE_COPY_RECT:
+        /* Each pixel is read and written. */
+        pixels = 2 * (uint32_t)cmd->copy_rect.width * cmd->copy_rect.height;
+        break;
+    case DOOMDEV2_CMD_TYPE_FILL_RECT:
+        pixels = (uint32_t)cmd->fill_rect.width * cmd->fill_rect.height;
+        break;
+    case DOOMDEV2_CMD_TYPE_DRAW_LINE: {
+        const struct doomdev2_cmd_draw_line* line = &cmd->draw_line;
+        pixels = max(abs((int)line->pos_b_x - line->pos_a_x), abs((int)line->pos_b_y - line->pos_a_y)) + 1;
+        break;
+    }
+    case DOOMDEV2_CMD_TYPE_DRAW_BACKGROUND:
+        pixels = (uint32_t)cmd->draw_background.width * cmd->draw_background.height;
+        break;
+    case DOOMDEV2_CMD_TYPE_DRAW_COLUMN:
+        pixels = cmd->draw_column.pos_b_y - cmd->draw_column.pos_a_y + 1;
+        break;
+    case DOOMDEV2_CMD_TYPE_DRAW_SPAN:
+        pixels = cmd->draw_span.pos_b_x - cmd->draw_span.pos_a_x + 1;
+        break;
+    case DOOMDEV2_CMD_TYPE_DRAW_FUZZ:
+        /* Fuzz reads the neighbouring pixels too. */
+        pixels = 3 * (cmd->draw_fuzz.pos_b_y - cmd->draw_fuzz.pos_a_y + 1);
+        break;
+    default:
+        BUG();
+    }
+
+    return CMD_BASE_COST + pixels;
+}
+
+size_t cmds_within_cost(const struct doomdev2_cmd* cmds, size_t num_cmds, uint64_t* cost, uint64_t max_cost) {
+    size_t it;
+    for (it = 0; it < num_cmds; ++it) {
+        uint32_t cmd = cmd_cost(&cmds[it]);
+        if (*cost && *cost + cmd > max_cost) {
+            break;
+        }
+        *cost += cmd;
+    }
+    return it;
+}
@@ -0,0 +1,53 @@
+#ifndef VALIDATE_H
+#define VALIDATE_H
+
+#include <linux/types.h>
+
+#include "doomdev2.h"
+
+#include "hd2_buffer.h"
+
+#define DRAW_FLAGS_COMBINATIONS \
+    ((DOOMDEV2_CMD_FLAGS_TRANSLATE | DOOMDEV2_CMD_FLAGS_COLORMAP | DOOMDEV2_CMD_FLAGS_TRANMAP) + 1)
+
+/* What commands may do with a given set of buffers. Computed once when the buffers are set,
+   so that checking a command doesn't have to look at the buffers themselves. */
+struct bind_limits {
+    /* Dimensions of the destination surface (and the source one, which has to match).
+       Both are 0 if there's no destination surface. */
+    uint16_t surf_width;
+    uint16_t surf_height;
+
+    /* Number of flats, 0 if the buffer isn't set. */
+    uint32_t flats;
+
+    /* Indexed by the flags of DRAW_COLUMN and DRAW_SPAN: exclusive upper bounds of the translation
+       and colormap indices. A bound is 0 if the flags need a buffer which isn't set (which makes
+       every index invalid), and above any index if the flags don't use it. */
+    uint32_t translation_bound[DRAW_FLAGS_COMBINATIONS];
+    uint32_t colormap_bound[DRAW_FLAGS_COMBINATIONS];
+
+    /* Size of the texture in 64-byte units minus one, as the device wants it in DRAW_COLUMN. */
+    uint32_t texture_limit;
+
+    bool has_src;
+    bool has_texture;
+    /* Are the source and destination surfaces the same buffer? */
+    bool src_is_dst;
+};
+
+void compute_bind_limits(struct bind_limits* limits, struct hd2_buffer* bufs[NUM_USER_BUFS]);
+
+/* Check which commands in 'cmds' are safe to send to the device with buffers described by 'limits'.
+   Returns the length of the valid prefix. */
+size_t validate_cmds(const struct bind_limits* limits, const struct doomdev2_cmd* cmds, size_t num_cmds);
+
+/* Estimated device time of a valid command, in pixels. */
+uint32_t cmd_cost(const struct doomdev2_cmd* cmd);
+
+/* Add the estimated device time (in pixels) of valid commands from 'cmds' to 'cost', as long as
+   it stays within 'max_cost' (the first command is always taken if 'cost' is 0).
+   Returns the number of commands taken. */
+size_t cmds_within_cost(const struct doomdev2_cmd* cmds, size_t num_cmds, uint64_t* cost, uint64_t max_cost);
+
+#endif